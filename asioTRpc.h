@@ -1,9 +1,25 @@
 #pragma once
+#include "lz.h"
 #include "trpc.h"
 
+#include <algorithm>
+#include <array>
 #include <asio.hpp>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstring>
 #include <functional>
 #include <map>
+#include <thread>
+#if __has_include(<span>)
+#include <span>
+#endif
+#ifdef ASIO_HAS_LOCAL_SOCKETS
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace trpc {
 
@@ -17,30 +33,146 @@ using Action = function<void(Args...)>;
 
 //////////////////////////////////////////////////////////////////////////
 
+// Raw writes every scalar at its full width. Compact writes integers,
+// lengths and counts as LEB128 varints, zigzag encoding signed ones first.
+// Both put multi-byte values on the wire in little-endian order.
+enum class Codec {
+  Raw,
+  Compact,
+};
+
+namespace imp {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+constexpr bool BigEndianHost = true;
+#else
+constexpr bool BigEndianHost = false;
+#endif
+
+// converts between host and little-endian order, both ways.
+template <typename T>
+T littleEndian(T v) {
+  if constexpr (BigEndianHost && sizeof(T) > 1) {
+    char b[sizeof(T)];
+    memcpy(b, &v, sizeof(T));
+    reverse(b, b + sizeof(T));
+    memcpy(&v, b, sizeof(T));
+  }
+  return v;
+}
+
+inline uint64_t zigzag(int64_t v) {
+  return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+inline int64_t unzigzag(uint64_t v) {
+  return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+constexpr size_t MaxVarintSize = 10;
+
+// LEB128 encode `v` to `p`, returns the bytes used.
+inline size_t putVarint(char* p, uint64_t v) {
+  size_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (char)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (char)v;
+  return n;
+}
+
+template <typename T>
+uint64_t toVarint(T v) {
+  return is_signed_v<T> ? zigzag(v) : (uint64_t)v;
+}
+
+// true if T goes on the wire as its in-memory bytes in little-endian order,
+// so a whole block of them can be copied at once.
+template <typename T>
+bool bulkCopyable(Codec c) {
+  if constexpr (is_arithmetic_v<T> && !is_same_v<T, bool>)
+    return is_floating_point_v<T> || sizeof(T) == 1 || c == Codec::Raw;
+  else
+    return false;
+}
+
+// byte-swap a copied block in place on big-endian hosts.
+template <typename T>
+void littleEndianBlock(T* p, size_t n) {
+  if constexpr (BigEndianHost && sizeof(T) > 1) {
+    for (size_t i = 0; i < n; i++)
+      p[i] = littleEndian(p[i]);
+  }
+}
+}  // namespace imp
+
+//////////////////////////////////////////////////////////////////////////
+
+// Sent like a string. A received one points into the frame it came in and
+// keeps that alive until the last copy is gone.
+struct Bytes {
+  const char* data = nullptr;
+  size_t size = 0;
+  shared_ptr<const void> owner;
+
+  Bytes() = default;
+  Bytes(string_view s) : data(s.data()), size(s.size()) {}
+  Bytes(const char* d, size_t n, shared_ptr<const void> o = nullptr)
+      : data(d), size(n), owner(move(o)) {}
+
+  string_view view() const { return {data, size}; }
+};
+
+//////////////////////////////////////////////////////////////////////////
+
 class MemIStream {
  public:
-  MemIStream() : m_buffer(make_shared<string>()), m_cursor(0) {}
-  MemIStream(shared_ptr<string> buf) : m_buffer(buf), m_cursor(0) {}
-  MemIStream(const string& s) : m_buffer(make_shared<string>(s)), m_cursor(0) {}
+  MemIStream() : MemIStream(make_shared<string>()) {}
+  MemIStream(shared_ptr<string> buf)
+      : m_buffer(buf), m_data(buf->data()), m_size(buf->size()), m_cursor(0) {}
+  MemIStream(const string& s) : MemIStream(make_shared<string>(s)) {}
+  // view over bytes owned by the caller, nothing is copied. `owner` keeps
+  // them alive for pin().
+  MemIStream(const char* data,
+             size_t size,
+             Codec codec = Codec::Raw,
+             shared_ptr<const void> owner = nullptr)
+      : m_owner(move(owner)),
+        m_data(data),
+        m_size(size),
+        m_cursor(0),
+        m_codec(codec) {}
+
+  void setCodec(Codec c) { m_codec = c; }
+  Codec getCodec() const { return m_codec; }
+  // arithmetic values are on the wire as their in-memory bytes.
+  bool rawLayout() const {
+    return m_codec == Codec::Raw && !imp::BigEndianHost;
+  }
 
   void reset() {
     m_cursor = 0;
     resize(0);
   }
-  void resize(size_t sz) { m_buffer->resize(sz); }
-  char* data() const { return m_buffer->data(); }
-  size_t getSize() const { return m_buffer->size(); }
-  size_t getUnreadSize() const {
-    return valid() ? m_buffer->length() - m_cursor : 0;
+  void resize(size_t sz) {
+    m_buffer->resize(sz);
+    m_data = m_buffer->data();
+    m_size = sz;
+  }
+  const char* data() const { return m_data; }
+  size_t getSize() const { return m_size; }
+  size_t getUnreadSize() const { return valid() ? m_size - m_cursor : 0; }
+  bool valid() const { return m_cursor < m_size; }
+  bool has(size_t len) const { return m_cursor + len <= m_size; }
+
+  // keeps the bytes being read alive, for views that outlive the stream.
+  shared_ptr<const void> pin() const {
+    if (m_owner)
+      return m_owner;
+    return m_buffer;
   }
-  bool valid() const { return m_cursor < m_buffer->size(); }
 
   bool read(char* buf, int len) {
-    auto oldPos = m_cursor;
-    m_cursor += len;
-    bool isValid = valid();
-    m_cursor = oldPos;
-    if (!isValid)
+    if (!has(len))
       return false;
     memcpy(buf, data() + m_cursor, len);
     m_cursor += len;
@@ -52,25 +184,103 @@ class MemIStream {
     return valid();
   }
 
+  bool readVarint(uint64_t& v) {
+    v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (!has(1))
+        return false;
+      auto b = (uint8_t)m_data[m_cursor++];
+      v |= (uint64_t)(b & 0x7f) << shift;
+      if (!(b & 0x80))
+        return true;
+    }
+    return false;
+  }
+
+  // length or element count, never more than the bytes left to hold them.
+  bool readSize(size_t& o) {
+    uint64_t v;
+    if (m_codec == Codec::Compact) {
+      if (!readVarint(v))
+        return false;
+    } else {
+      if (!has(sizeof(v)))
+        return false;
+      memcpy(&v, data() + m_cursor, sizeof(v));
+      v = imp::littleEndian(v);
+      m_cursor += sizeof(v);
+    }
+    o = (size_t)v;
+    return v <= m_size - m_cursor;
+  }
+
+  // read `n` elements, with a single bounds check and copy if they are
+  // bulk copyable.
+  template <typename T>
+  bool readBlock(T* p, size_t n) {
+    if (imp::bulkCopyable<T>(m_codec)) {
+      auto len = n * sizeof(T);
+      if (!has(len))
+        return false;
+      memcpy(p, data() + m_cursor, len);
+      imp::littleEndianBlock(p, n);
+      m_cursor += len;
+      return true;
+    }
+    for (size_t i = 0; i < n; i++) {
+      if (!(*this >> p[i]))
+        return false;
+    }
+    return true;
+  }
+
   template <typename T>
   bool operator>>(vector<T>& o) {
-    int cnt;
-    if (!(*this >> cnt))
+    size_t cnt;
+    if (!readSize(cnt))
       return false;
     o.resize(cnt);
-    for (int i = 0; i < cnt; i++) {
-      if (!(*this >> o[i]))
-        return false;
+    if constexpr (!is_same_v<T, bool>) {
+      return readBlock(o.data(), cnt);
+    } else {
+      for (size_t i = 0; i < cnt; i++) {
+        bool v;
+        if (!(*this >> v))
+          return false;
+        o[i] = v;
+      }
+      return true;
     }
-    return true;
+  }
+
+  // sent with a count like vector, which must match N.
+  template <typename T, size_t N>
+  bool operator>>(array<T, N>& o) {
+    size_t cnt;
+    if (!readSize(cnt) || cnt != N)
+      return false;
+    return readBlock(o.data(), N);
   }
 
   template <typename K, typename V>
   bool operator>>(map<K, V>& o) {
-    int cnt;
-    if (!(*this >> cnt))
+    size_t cnt;
+    if (!readSize(cnt))
       return false;
-    for (int i = 0; i < cnt; i++) {
+    if (imp::bulkCopyable<K>(m_codec) && imp::bulkCopyable<V>(m_codec)) {
+      if (!has(cnt * (sizeof(K) + sizeof(V))))
+        return false;
+      for (size_t i = 0; i < cnt; i++) {
+        K key;
+        V val;
+        memcpy(&key, data() + m_cursor, sizeof(K));
+        memcpy(&val, data() + m_cursor + sizeof(K), sizeof(V));
+        m_cursor += sizeof(K) + sizeof(V);
+        o.emplace_hint(o.end(), imp::littleEndian(key), imp::littleEndian(val));
+      }
+      return true;
+    }
+    for (size_t i = 0; i < cnt; i++) {
       K key;
       V val;
       if (!(*this >> key) || !(*this >> val))
@@ -80,29 +290,231 @@ class MemIStream {
     return true;
   }
 
+  // enums go through the operators in trpc::imp as their underlying type.
   template <typename T>
-  typename enable_if<!is_class<T>::value, bool>::type operator>>(T& o) {
-    if (!valid())
+  typename enable_if<!is_class<T>::value && !is_enum<T>::value, bool>::type
+  operator>>(T& o) {
+    if constexpr (is_integral_v<T> && sizeof(T) > 1) {
+      if (m_codec == Codec::Compact) {
+        uint64_t v;
+        if (!readVarint(v))
+          return false;
+        o = is_signed_v<T> ? (T)imp::unzigzag(v) : (T)v;
+        return true;
+      }
+    }
+    if (!has(sizeof(o)))
       return false;
-    o = *(T*)(data() + m_cursor);  // TODO: byte order
+    memcpy(&o, data() + m_cursor, sizeof(o));
+    o = imp::littleEndian(o);
     m_cursor += sizeof(o);
     return true;
   }
 
   bool operator>>(string& o) {
-    if (!valid())
-      return false;
     size_t len;
-    if (!(*this >> len))
+    if (!readSize(len))
       return false;
     o.assign(data() + m_cursor, len);
     m_cursor += len;
-    return valid();
+    return true;
+  }
+
+  // Views into the frame, nothing is copied. They are valid while the
+  // stream's bytes are, which for a received frame is until the handler
+  // returns, or pooled handlers finish. Keep a Bytes to hold on longer.
+  bool operator>>(string_view& o) {
+    size_t len;
+    if (!readSize(len))
+      return false;
+    o = string_view(data() + m_cursor, len);
+    m_cursor += len;
+    return true;
+  }
+
+  bool operator>>(Bytes& o) {
+    string_view v;
+    if (!(*this >> v))
+      return false;
+    o = Bytes(v.data(), v.size(), pin());
+    return true;
   }
 
+#ifdef __cpp_lib_span
+  // only for byte-sized elements, wider ones may sit unaligned in the frame.
+  template <typename T>
+  bool operator>>(span<const T>& o) {
+    static_assert(sizeof(T) == 1 && is_arithmetic_v<T> && !is_same_v<T, bool>,
+                  "span arguments must be of char, int8_t or uint8_t");
+    string_view v;
+    if (!(*this >> v))
+      return false;
+    o = span<const T>((const T*)v.data(), v.size());
+    return true;
+  }
+#endif
+
  private:
+  shared_ptr<const void> m_owner;
   shared_ptr<string> m_buffer;
+  const char* m_data;
+  size_t m_size;
   size_t m_cursor;
+  Codec m_codec = Codec::Raw;
+};
+
+inline bool hasMore(MemIStream& s) {
+  return s.valid();
+}
+
+inline size_t readOffset(MemIStream& s) {
+  return s.getSize() - s.getUnreadSize();
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+// Contiguous receive buffer. The socket reads straight into the free tail,
+// complete frames are handed out as views into it and whatever is left of a
+// partial frame is moved back to the front after every read, so the buffer
+// only ever grows to the largest frame seen. While a frame is pinned through
+// owner() the storage is left alone and reading continues in a new one.
+class RecvBuffer {
+ public:
+  static constexpr size_t MinRead = 1024 * 4;
+
+  RecvBuffer() : m_buffer(make_shared<vector<char>>(MinRead)) {}
+
+  char* writePtr() { return m_buffer->data() + m_end; }
+  size_t writable() const { return m_buffer->size() - m_end; }
+  void commit(size_t len) { m_end += len; }
+
+  const char* readPtr() const { return m_buffer->data() + m_begin; }
+  size_t readable() const { return m_end - m_begin; }
+  void consume(size_t len) { m_begin += len; }
+  void clear() { m_begin = m_end = 0; }
+
+  shared_ptr<const void> owner() const { return m_buffer; }
+
+  // drop consumed bytes and make room to read `room` more, MinRead at
+  // least.
+  void compact(size_t room) {
+    auto unread = readable();
+    auto need = unread + std::max(room, MinRead);
+    if (m_buffer.use_count() > 1) {
+      auto fresh = make_shared<vector<char>>(std::max(need, m_buffer->size()));
+      memcpy(fresh->data(), readPtr(), unread);
+      m_buffer = move(fresh);
+      m_begin = 0;
+      m_end = unread;
+      return;
+    }
+    if (m_begin) {
+      memmove(m_buffer->data(), readPtr(), unread);
+      m_begin = 0;
+      m_end = unread;
+    }
+    if (need > m_buffer->size())
+      m_buffer->resize(need);
+  }
+
+ private:
+  shared_ptr<vector<char>> m_buffer;
+  size_t m_begin = 0;
+  size_t m_end = 0;
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+// Cuts the bytes read into `input` into frames. A frame header is the
+// little-endian 64-bit payload size with flags on top. A compressed payload
+// starts with its little-endian 64-bit size before compression.
+class FrameReader {
+ public:
+  static constexpr uint64_t FrameCompact = 1ull << 63;
+  static constexpr uint64_t FrameCompressed = 1ull << 62;
+  static constexpr uint64_t FrameSizeMask = (1ull << 56) - 1;
+  static constexpr size_t DefaultMaxFrame = 64 << 20;
+
+  RecvBuffer input;
+  // larger frames, before or after decompression, are malformed.
+  size_t maxFrame = DefaultMaxFrame;
+
+  // hand every complete frame to `receiver`, false on a malformed one.
+  bool parse(const Action<MemIStream&>& receiver) {
+    auto owner = input.owner();
+    for (;;) {
+      if (!haveHeader) {
+        uint64_t head;
+        if (input.readable() < sizeof(head))
+          break;
+        memcpy(&head, input.readPtr(), sizeof(head));
+        input.consume(sizeof(head));
+        head = imp::littleEndian(head);
+        packageSize = head & FrameSizeMask;
+        packageFlags = head & ~FrameSizeMask;
+        haveHeader = true;
+        if (packageSize > maxFrame)
+          return false;
+      }
+      if (input.readable() < packageSize)
+        break;
+      auto codec = packageFlags & FrameCompact ? Codec::Compact : Codec::Raw;
+      if (packageFlags & FrameCompressed) {
+        if (!inflate(input.readPtr(), packageSize))
+          return false;
+        input.consume(packageSize);
+        packageSize = 0;
+        haveHeader = false;
+        MemIStream frame(inflated->data(), inflated->size(), codec, inflated);
+        receiver(frame);
+        continue;
+      }
+      MemIStream frame(input.readPtr(), packageSize, codec, owner);
+      input.consume(packageSize);
+      packageSize = 0;
+      haveHeader = false;
+      receiver(frame);
+    }
+    owner = nullptr;
+    // the rest of a frame can't be trusted to come, room grows with the
+    // bytes that did.
+    auto unread = input.readable();
+    input.compact(packageSize > unread ? std::min(packageSize - unread, unread)
+                                       : 0);
+    return true;
+  }
+
+  void reset() {
+    input.clear();
+    packageSize = 0;
+    packageFlags = 0;
+    haveHeader = false;
+  }
+
+ private:
+  // decompress a frame into `inflated`, false if it is malformed.
+  bool inflate(const char* p, size_t n) {
+    uint64_t raw;
+    if (n < sizeof(raw))
+      return false;
+    memcpy(&raw, p, sizeof(raw));
+    raw = imp::littleEndian(raw);
+    // no sequence expands more than ~255 times, don't let a bogus size
+    // allocate more.
+    if (raw / 256 > n || raw > maxFrame)
+      return false;
+    // views into the last frame may still be pinned.
+    if (!inflated || inflated.use_count() > 1)
+      inflated = make_shared<string>();
+    return LzCodec::decompress(p + sizeof(raw), n - sizeof(raw), *inflated,
+                               (size_t)raw);
+  }
+
+  size_t packageSize = 0;
+  uint64_t packageFlags = 0;
+  // the header of the frame being read is in, its size may be zero.
+  bool haveHeader = false;
+  shared_ptr<string> inflated;
 };
 
 //////////////////////////////////////////////////////////////////////////
@@ -112,32 +524,124 @@ class MemOStream {
   MemOStream(shared_ptr<string> buf) : m_buffer(buf), m_offset(0) {}
   MemOStream() : m_buffer(make_shared<string>()), m_offset(0) {}
 
+  void setCodec(Codec c) { m_codec = c; }
+  Codec getCodec() const { return m_codec; }
+  // arithmetic values are on the wire as their in-memory bytes.
+  bool rawLayout() const {
+    return m_codec == Codec::Raw && !imp::BigEndianHost;
+  }
+
   const char* data() const { return m_buffer->data(); }
   size_t getSize() const { return m_offset; }
-  void reset() { m_offset = 0; }
+  void reset() {
+    m_offset = 0;
+    m_compressible = false;
+  }
 
-  int write(const char* buf, int len) {
-    if (m_offset >= m_buffer->length()) {
-      m_buffer->append(buf, len);
-    } else {
-      m_buffer->replace(m_offset, len, buf, len);
-    }
-    m_offset += len;
+  // ask the transport to compress the frame holding what was written.
+  void markCompressible() { m_compressible = true; }
+  bool compressible() const { return m_compressible; }
+
+  // hand the written bytes over to `s` and keep writing into the storage `s`
+  // had before, nothing is copied.
+  void swap(string& s) {
+    m_buffer->resize(m_offset);
+    m_buffer->swap(s);
+    m_buffer->clear();
+    m_offset = 0;
+    m_compressible = false;
+  }
+
+  size_t write(const char* buf, size_t len) {
+    memcpy(grow(len), buf, len);
     return len;
   }
 
+  // make room for `len` more bytes and return where they go.
+  char* grow(size_t len) {
+    if (m_offset + len > m_buffer->size())
+      m_buffer->resize(m_offset + len);
+    auto p = &(*m_buffer)[m_offset];
+    m_offset += len;
+    return p;
+  }
+
+  // write `n` elements, in one copy if they are bulk copyable.
   template <typename T>
-  bool operator<<(const vector<T>& o) {
-    *this << o.size();
-    for (size_t i = 0; i < o.size(); i++) {
-      *this << o[i];
+  bool writeBlock(const T* p, size_t n) {
+    if (imp::bulkCopyable<T>(m_codec)) {
+      auto dst = grow(n * sizeof(T));
+      memcpy(dst, p, n * sizeof(T));
+      imp::littleEndianBlock((T*)dst, n);
+      return true;
     }
+    if constexpr (is_integral_v<T> && !is_same_v<T, bool>) {
+      // compact integers: one bounds check for the worst case.
+      auto dst = grow(n * imp::MaxVarintSize), end = dst;
+      for (size_t i = 0; i < n; i++)
+        end += imp::putVarint(end, imp::toVarint(p[i]));
+      m_offset -= n * imp::MaxVarintSize - (end - dst);
+      return true;
+    }
+    for (size_t i = 0; i < n; i++)
+      *this << p[i];
     return true;
   }
 
+  bool writeVarint(uint64_t v) {
+    auto p = grow(imp::MaxVarintSize);
+    m_offset -= imp::MaxVarintSize - imp::putVarint(p, v);
+    return true;
+  }
+
+  bool writeSize(size_t o) {
+    if (m_codec == Codec::Compact)
+      return writeVarint(o);
+    auto v = imp::littleEndian((uint64_t)o);
+    write((const char*)&v, sizeof(v));
+    return true;
+  }
+
+  template <typename T>
+  bool operator<<(const vector<T>& o) {
+    writeSize(o.size());
+    if constexpr (!is_same_v<T, bool>) {
+      return writeBlock(o.data(), o.size());
+    } else {
+      for (size_t i = 0; i < o.size(); i++)
+        *this << (bool)o[i];
+      return true;
+    }
+  }
+
+  template <typename T, size_t N>
+  bool operator<<(const array<T, N>& o) {
+    writeSize(N);
+    return writeBlock(o.data(), N);
+  }
+
+#ifdef __cpp_lib_span
+  template <typename T, size_t N>
+  bool operator<<(span<T, N> o) {
+    writeSize(o.size());
+    return writeBlock(o.data(), o.size());
+  }
+#endif
+
   template <typename K, typename V>
   bool operator<<(const map<K, V>& o) {
-    *this << o.size();
+    writeSize(o.size());
+    if (imp::bulkCopyable<K>(m_codec) && imp::bulkCopyable<V>(m_codec)) {
+      auto dst = grow(o.size() * (sizeof(K) + sizeof(V)));
+      for (auto& i : o) {
+        auto k = imp::littleEndian(i.first);
+        auto v = imp::littleEndian(i.second);
+        memcpy(dst, &k, sizeof(K));
+        memcpy(dst + sizeof(K), &v, sizeof(V));
+        dst += sizeof(K) + sizeof(V);
+      }
+      return true;
+    }
     for (auto i = o.begin(); i != o.end(); ++i) {
       if (!(*this << i->first))
         return false;
@@ -147,170 +651,799 @@ class MemOStream {
     return true;
   }
 
+  // enums go through the operators in trpc::imp as their underlying type.
   template <typename T>
-  typename enable_if<!is_class<T>::value, bool>::type operator<<(const T& o) {
-    // TODO: byte order
-    write((const char*)&o, sizeof(o));
+  typename enable_if<!is_class<T>::value && !is_enum<T>::value, bool>::type
+  operator<<(const T& o) {
+    if constexpr (is_integral_v<T> && sizeof(T) > 1) {
+      if (m_codec == Codec::Compact)
+        return writeVarint(imp::toVarint(o));
+    }
+    auto v = imp::littleEndian(o);
+    write((const char*)&v, sizeof(v));
     return true;
   }
 
   bool operator<<(const string& o) {
-    *this << o.size();
+    writeSize(o.size());
     write(o.data(), o.size());
     return true;
   }
 
+  bool operator<<(const char* o) {
+    auto len = strlen(o);
+    writeSize(len);
+    write(o, len);
+    return true;
+  }
+
+  bool operator<<(string_view o) {
+    writeSize(o.size());
+    write(o.data(), o.size());
+    return true;
+  }
+
+  bool operator<<(const Bytes& o) { return *this << o.view(); }
+
  private:
   shared_ptr<string> m_buffer;
   size_t m_offset;
+  Codec m_codec = Codec::Raw;
+  bool m_compressible = false;
 };
 
+inline size_t writeOffset(MemOStream& s) {
+  return s.getSize();
+}
+
+inline void markCompressible(MemOStream& s) {
+  s.markCompressible();
+}
+
 //////////////////////////////////////////////////////////////////////////
 
-class AsioPeer {
+// The transport over a stream socket of `Protocol`: asio::ip::tcp or
+// asio::local::stream_protocol for Unix domain sockets, which skip the
+// checksums, Nagle and ACKs of TCP loopback between processes on one host.
+template <typename Protocol>
+class BasicAsioPeer {
  public:
-  virtual ~AsioPeer() {}
-  virtual tcp::socket* getSocket() = 0;
+  using Socket = typename Protocol::socket;
+
+  // With batching enabled, everything flushed during one event-loop turn is
+  // sent as a single frame when the turn ends, or `delay` later if set.
+  // Reaching `maxBytes` sends right away.
+  struct Batching {
+    bool enabled = false;
+    size_t maxBytes = 64 * 1024;
+    std::chrono::microseconds delay{0};
+  };
+  // Once more than `high` bytes of frames wait to be written the peer stops
+  // being writable, until they drain to `low`. Zero `high` turns it off.
+  // Past `limit` bytes onOverLimit() is called, zero means 8 times `high`.
+  struct Watermarks {
+    size_t high = 0;
+    size_t low = 0;
+    size_t limit = 0;
+  };
+  // Frames of at least `threshold` bytes are compressed, zero turns that
+  // off. Frames holding replies of handler functions set to compress are
+  // compressed from `minBytes` on. A frame only goes out compressed if that
+  // makes it smaller. Compressed frames are always accepted.
+  struct Compression {
+    size_t threshold = 0;
+    size_t minBytes = 64;
+  };
+  struct Stats {
+    size_t frames = 0;
+    size_t writes = 0;
+    size_t bytes = 0;
+    // frames sent compressed and the bytes that saved.
+    size_t compressed = 0;
+    size_t saved = 0;
+  };
+
+  Batching batching;
+  Watermarks watermarks;
+  Compression compression;
+  Stats stats;
+
+  virtual ~BasicAsioPeer() {}
+  virtual Socket* getSocket() = 0;
   virtual void onError(const error_code& err) {
     printf("error: %s\n", err.message().c_str());
   }
+  // crossed a watermark.
+  virtual void onWritable(bool) {}
+  // the last read or write in flight completed.
+  virtual void onIdle() {}
+  // frames queued past the hard limit of `watermarks`.
+  virtual void onOverLimit() {}
 
+  bool writable() const { return isWritable; }
+  size_t queuedBytes() const { return queued; }
+  // frames received larger than `n` bytes are an error.
+  void setMaxFrame(size_t n) { frames.maxFrame = n; }
+
+  // Queue the bytes written to `body` as one frame. Frames queued while a
+  // write is in flight go out together in a single gathered write once it
+  // completes.
   void send(MemOStream& body) {
-    auto head = make_shared<MemOStream>();
-    *head << (decltype(packageSize))body.getSize();
-    std::array<const_buffer, 2> data{
-        asio::buffer(head->data(), head->getSize()),
-        asio::buffer(body.data(), body.getSize()),
+    Frame f;
+    uint64_t flags = 0;
+    if (body.getCodec() == Codec::Compact)
+      flags |= FrameCompact;
+    auto marked = body.compressible();
+    if (!spareBodies.empty()) {
+      f.body = move(spareBodies.back());
+      spareBodies.pop_back();
+    }
+    body.swap(f.body);
+    if (deflate(f.body, marked))
+      flags |= FrameCompressed;
+    f.head = imp::littleEndian(f.body.size() | flags);
+    queued += sizeof(f.head) + f.body.size();
+    pending.push_back(move(f));
+    stats.frames++;
+    if (writing.empty())
+      write();
+    updateWritable();
+  }
+
+  // Encode `body` as a frame to queue on any number of peers with
+  // sendShared(), compressed as `compression` says. `body` is reset.
+  static SharedFrame shareFrame(MemOStream& body,
+                                const Compression& compression) {
+    uint64_t flags = 0;
+    if (body.getCodec() == Codec::Compact)
+      flags |= FrameCompact;
+    auto marked = body.compressible();
+    string raw, packed;
+    body.swap(raw);
+    LzCodec lz;
+    if (pack(raw, marked, compression, lz, packed))
+      flags |= FrameCompressed;
+    auto head = imp::littleEndian(raw.size() | flags);
+    auto frame = make_shared<string>();
+    frame->reserve(sizeof(head) + raw.size());
+    frame->append((const char*)&head, sizeof(head));
+    frame->append(raw);
+    return frame;
+  }
+
+  // queue a frame made by shareFrame(), it is written from where it is.
+  void sendShared(const SharedFrame& frame) {
+    Frame f;
+    f.shared = frame;
+    queued += f.size();
+    pending.push_back(move(f));
+    stats.frames++;
+    if (writing.empty())
+      write();
+    updateWritable();
+  }
+
+  // send() now, or as part of the current batch.
+  void sendBatched(MemOStream& body) {
+    if (!batching.enabled || body.getSize() >= batching.maxBytes) {
+      send(body);
+      return;
+    }
+    if (batchPending)
+      return;
+    batchPending = true;
+    // a session reused in the meantime just gets its output flushed early.
+    auto done = [this, &body] {
+      batchPending = false;
+      if (body.getSize())
+        send(body);
     };
-    body.reset();
-    async_write(*getSocket(), data,
-                [this, head](const error_code& err, int len) {
-                  if (err) {
-                    onError(err);
-                    return;
-                  }
-                });
+    if (!batching.delay.count()) {
+      asio::post(getSocket()->get_executor(), done);
+      return;
+    }
+    if (!batchTimer)
+      batchTimer = make_unique<steady_timer>(getSocket()->get_executor());
+    batchTimer->expires_after(batching.delay);
+    batchTimer->async_wait([done](const error_code&) { done(); });
   }
 
   void receive(const Action<MemIStream&>& onReceived) {
+    receiver = onReceived;
+    paused = false;
+    readSome();
+  }
+
+  // stop reading after the frames already received, the peer's sends back up
+  // into its socket. Used for backpressure.
+  void pauseReceive() { paused = true; }
+  void resumeReceive() {
+    paused = false;
+    if (!reading && receiver)
+      readSome();
+  }
+
+  // no read or write is in flight.
+  bool idle() const { return !reading && writing.empty(); }
+
+  // forget all buffered input and output so the peer can serve a new socket.
+  void resetPeer() {
+    frames.reset();
+    pending.clear();
+    queued = 0;
+    isWritable = true;
+    paused = false;
+  }
+
+  // stream chunks and the credit for them go back and forth in small
+  // frames, Nagle would hold each behind a delayed ack.
+  void noDelay() {
+    if constexpr (std::is_same_v<Protocol, tcp>) {
+      error_code ec;
+      getSocket()->set_option(tcp::no_delay(true), ec);
+    }
+  }
+
+ protected:
+  static constexpr uint64_t FrameCompact = FrameReader::FrameCompact;
+  static constexpr uint64_t FrameCompressed = FrameReader::FrameCompressed;
+
+  struct Frame {
+    uint64_t head;
+    string body;
+    // head and body together, of a frame sent as is.
+    SharedFrame shared;
+
+    size_t size() const {
+      return shared ? shared->size() : sizeof(head) + body.size();
+    }
+  };
+  static constexpr size_t MaxSpareBodies = 64;
+
+  void readSome() {
+    reading = true;
     getSocket()->async_receive(
-        buffer(inputBuffer),
-        [this, onReceived](const error_code& err, int len) {
+        buffer(frames.input.writePtr(), frames.input.writable()),
+        [this](const error_code& err, int len) {
+          reading = false;
           if (err) {
             onError(err);
+            if (idle())
+              onIdle();
             return;
           }
 
-          auto oldSize = input.getSize();
-          input.resize(oldSize + len);
-          memcpy(input.data() + oldSize, inputBuffer, len);
-
-          while (input.valid()) {
-            if (packageSize) {
-              if (input.getUnreadSize() >= packageSize) {
-                onReceived(input);
-                packageSize = 0;
-              } else {
-                break;
-              }
-            } else {
-              if (input.getUnreadSize() >= sizeof(packageSize)) {
-                input >> packageSize;
-              } else {
-                break;
-              }
-            }
+          frames.input.commit(len);
+          if (!frames.parse(receiver)) {
+            onError(asio::error::invalid_argument);
+            return;
           }
-          if (!input.valid())
-            input.reset();
 
-          receive(onReceived);
+          // parse() may have closed the socket, from the overflow policy or
+          // a handler.
+          if (!paused && getSocket()->is_open())
+            readSome();
+          else if (idle())
+            onIdle();
         });
   }
 
- protected:
-  MemIStream input;
-  char inputBuffer[1024 * 4];
-  size_t packageSize = 0;
+  // compress `body` in place, false if it is left as is.
+  bool deflate(string& body, bool marked) {
+    auto n = body.size();
+    if (!pack(body, marked, compression, lz, packed))
+      return false;
+    stats.compressed++;
+    stats.saved += n - body.size();
+    return true;
+  }
+
+  static bool pack(string& body,
+                   bool marked,
+                   const Compression& compression,
+                   LzCodec& lz,
+                   string& packed) {
+    auto n = body.size();
+    auto wanted = marked ? n >= compression.minBytes
+                         : compression.threshold && n >= compression.threshold;
+    if (!wanted)
+      return false;
+    packed.clear();
+    auto raw = imp::littleEndian((uint64_t)n);
+    packed.append((const char*)&raw, sizeof(raw));
+    lz.compress(body.data(), n, packed);
+    if (packed.size() >= n)
+      return false;
+    // the raw storage is kept for the next frame.
+    body.swap(packed);
+    return true;
+  }
+
+  void updateWritable() {
+    if (!watermarks.high)
+      return;
+    if (isWritable && queued > watermarks.high) {
+      isWritable = false;
+      onWritable(false);
+    } else if (!isWritable && queued <= watermarks.low) {
+      isWritable = true;
+      onWritable(true);
+    }
+    auto limit = watermarks.limit ? watermarks.limit : 8 * watermarks.high;
+    if (queued > limit)
+      onOverLimit();
+  }
+
+  void write() {
+    writing.swap(pending);
+    outputBuffers.clear();
+    for (auto& f : writing) {
+      if (f.shared) {
+        outputBuffers.push_back(buffer(*f.shared));
+      } else {
+        outputBuffers.push_back(buffer(&f.head, sizeof(f.head)));
+        outputBuffers.push_back(buffer(f.body));
+      }
+      stats.bytes += f.size();
+    }
+    stats.writes++;
+    async_write(*getSocket(), outputBuffers,
+                [this](const error_code& err, size_t) {
+                  if (err) {
+                    writing.clear();
+                    pending.clear();
+                    queued = 0;
+                    onError(err);
+                    if (idle())
+                      onIdle();
+                    return;
+                  }
+                  for (auto& f : writing) {
+                    queued -= f.size();
+                    if (!f.shared && spareBodies.size() < MaxSpareBodies)
+                      spareBodies.push_back(move(f.body));
+                  }
+                  writing.clear();
+                  if (!pending.empty())
+                    write();
+                  updateWritable();
+                  if (idle())
+                    onIdle();
+                });
+  }
+
+  FrameReader frames;
+  vector<Frame> pending, writing;
+  vector<string> spareBodies;
+  vector<const_buffer> outputBuffers;
+  LzCodec lz;
+  string packed;
+  bool reading = false;
+  bool paused = false;
+  Action<MemIStream&> receiver;
+  size_t queued = 0;
+  bool isWritable = true;
+  bool batchPending = false;
+  unique_ptr<steady_timer> batchTimer;
 };
 
-class AsioClient : public RpcClient<MemIStream, MemOStream>, public AsioPeer {
+using AsioPeer = BasicAsioPeer<tcp>;
+
+template <typename Protocol>
+class BasicAsioClient : public RpcClient<MemIStream, MemOStream>,
+                        public BasicAsioPeer<Protocol> {
  public:
-  AsioClient() : RpcClient(output) {}
+  using Endpoint = typename Protocol::endpoint;
+  using Socket = typename Protocol::socket;
+
+  BasicAsioClient() : RpcClient(output) {}
 
+  // TCP only.
   void connect(string host, int port, Action<bool> cb) {
-    tcp::endpoint ep(ip::address_v4::from_string(host), port);
+    connect(Endpoint(ip::address_v4::from_string(host), port), move(cb));
+  }
+
+  // a Unix domain socket is given by its path.
+  void connect(const Endpoint& ep, Action<bool> cb) {
     sock.async_connect(ep, [=](const error_code& err) {
       if (err) {
         cb(!err);
         return;
       }
+      this->noDelay();
       cb(true);
-      receive([this](MemIStream& in) { onReceive(in); });
+      this->receive([this](MemIStream& in) { onReceive(in); });
     });
 
-    flush = [this] { send(output); };
+    flush = [this] {
+      this->sendBatched(output);
+      armExpiry();
+    };
   }
 
-  tcp::socket* getSocket() override { return &sock; }
+  // codec of the frames this client sends, replies come in whatever codec
+  // the server uses.
+  void setCodec(Codec c) { output.setCodec(c); }
+
+  Socket* getSocket() override { return &sock; }
   void update() { ctx.poll(); }
 
+  // hang up, pending calls and streams end with Status::Cancelled.
+  void close() {
+    error_code ec;
+    sock.close(ec);
+    connectionLost();
+  }
+
+  void onError(const error_code& err) override {
+    if (err != asio::error::operation_aborted)
+      BasicAsioPeer<Protocol>::onError(err);
+    close();
+  }
+
  private:
+  // ticks the timing wheel only while calls with a deadline are pending.
+  void armExpiry() {
+    if (expiryArmed || !hasDeadlines())
+      return;
+    expiryArmed = true;
+    expiryTimer.expires_after(TimerTick);
+    expiryTimer.async_wait([this](const error_code& err) {
+      expiryArmed = false;
+      if (err)
+        return;
+      expire();
+      armExpiry();
+    });
+  }
+
   asio::io_context ctx;
-  tcp::socket sock{ctx};
+  Socket sock{ctx};
   MemOStream output;
+  steady_timer expiryTimer{ctx};
+  bool expiryArmed = false;
 };
 
 //////////////////////////////////////////////////////////////////////////
 
-class AsioServer : public RpcServer<MemIStream, MemOStream> {
+namespace imp {
+template <typename Endpoint>
+void removeSocketFile(const Endpoint&) {}
+template <typename Endpoint>
+bool removeStaleSocket(const Endpoint&) {
+  return true;
+}
+
+#ifdef ASIO_HAS_LOCAL_SOCKETS
+inline void removeSocketFile(const local::stream_protocol::endpoint& ep) {
+  if (!ep.path().empty())
+    std::remove(ep.path().c_str());
+}
+
+// bind() fails on a socket file left behind: remove it if it is a socket
+// no one listens on anymore. False if something else is there, a live
+// server or any other kind of file.
+inline bool removeStaleSocket(const local::stream_protocol::endpoint& ep) {
+  struct stat st;
+  if (ep.path().empty() || lstat(ep.path().c_str(), &st) != 0)
+    return true;
+  if (!S_ISSOCK(st.st_mode))
+    return false;
+  auto fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return false;
+  // a full backlog must not block us, it means someone listens.
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  auto refused =
+      ::connect(fd, ep.data(), ep.size()) != 0 && errno == ECONNREFUSED;
+  ::close(fd);
+  return refused && unlink(ep.path().c_str()) == 0;
+}
+#endif
+}  // namespace imp
+
+template <typename Protocol>
+class BasicAsioServer : public RpcServer<MemIStream, MemOStream> {
  public:
-  void start(int port, Action<bool> cb) {
-    acc = make_unique<tcp::acceptor>(ctx, tcp::endpoint(tcp::v4(), port));
-    acc->set_option(tcp::acceptor::reuse_address(true));
-    cb(true);
+  using Peer = BasicAsioPeer<Protocol>;
+  using Endpoint = typename Protocol::endpoint;
+  using Socket = typename Protocol::socket;
+  using Acceptor = typename Protocol::acceptor;
+
+  // accepts kept outstanding on every listening socket.
+  int pendingAccepts = 4;
+  // give every event loop its own SO_REUSEPORT listening socket and let the
+  // kernel spread connections, instead of one acceptor handing them out.
+  // TCP only.
+  bool reusePort = false;
+  // sessions allocated up front on every event loop.
+  int sessionPoolSize = 0;
+  // copied to every session when it opens.
+  typename Peer::Batching batching;
+  typename Peer::Watermarks watermarks;
+  typename Peer::Compression compression;
+  Codec codec = Codec::Raw;
+  // largest frame a client may send.
+  size_t maxFrame = FrameReader::DefaultMaxFrame;
+
+  ~BasicAsioServer() { stop(); }
 
-    auto sock = make_shared<tcp::socket>(ctx);
-    acc->async_accept(*sock, [this, sock](const error_code& err) {
-      auto& s = sessions[sessionID];
-      s.sock = sock;
-      s.sid = sessionID;
-      s.server = this;
-      sessionID++;
-      addSession(s.sid, s.os);
-      s.receive([this, sid = s.sid](MemIStream& in) { onReceive(sid, in); });
-
-      flush = [this](SessionID sid) {
-        if (sessions.find(sid) == sessions.end())
-          return;
-        auto& s = sessions[sid];
-        s.send(s.os);
+  // TCP on `port` of every interface.
+  void start(int port, Action<bool> cb, int threads = 0) {
+    start(Endpoint(tcp::v4(), port), move(cb), threads);
+  }
+
+  // threads == 0: a single event loop driven by update() on the caller's
+  // thread.
+  // threads > 0: that many event loops, each run by its own thread. Every
+  // accepted session is pinned to one loop which does all of its reads,
+  // dispatching and writes, so handlers of different sessions may run
+  // concurrently while a single session is never touched from two threads.
+  // Use post(sid, f) to reach a session from outside its loop.
+  // A Unix domain socket is given by its path. A socket file there that no
+  // server listens on is replaced, anything else fails start(). stop()
+  // removes the file again.
+  void start(const Endpoint& ep, Action<bool> cb, int threads = 0) {
+    auto cnt = std::max(threads, 1);
+    acceptorPerLoop = reusePort && is_same_v<Protocol, tcp>;
+    for (int i = 0; i < cnt; i++) {
+      loops.push_back(make_unique<Loop>());
+      auto& l = *loops.back();
+      l.index = i;
+      for (int j = 0; j < sessionPoolSize; j++)
+        l.freeSessions.push_back(newSession(l));
+      reverse(l.freeSessions.begin(), l.freeSessions.end());
+    }
+    setShards(cnt, sessionPoolSize);
+
+    flush = [this](SessionID sid) {
+      if (auto s = findSession(sid))
+        s->sendBatched(s->os);
+    };
+    post = [this](SessionID sid, Action<> f) {
+      asio::post(loopOf(sid).ctx, move(f));
+    };
+    if (watermarks.high) {
+      writable = [this](SessionID sid) {
+        auto s = findSession(sid);
+        return s && s->writable();
       };
-    });
+    }
+    encodeFrame = [this](const Action<MemOStream&>& write) {
+      MemOStream o;
+      o.setCodec(codec);
+      write(o);
+      return Peer::shareFrame(o, compression);
+    };
+    sendFrame = [this](SessionID sid, const SharedFrame& frame) {
+      auto s = findSession(sid);
+      if (!s)
+        return;
+      // what is held for the current batch goes first.
+      if (s->os.getSize())
+        s->send(s->os);
+      s->sendShared(frame);
+    };
+
+    if (!imp::removeStaleSocket(ep)) {
+      cb(false);
+      return;
+    }
+    try {
+      for (int i = 0; i < (acceptorPerLoop ? cnt : 1); i++) {
+        auto acc = make_unique<Acceptor>(loops[i]->ctx);
+        acc->open(ep.protocol());
+        acc->set_option(typename Acceptor::reuse_address(true));
+#ifdef SO_REUSEPORT
+        if (acceptorPerLoop) {
+          int on = 1;
+          setsockopt(acc->native_handle(), SOL_SOCKET, SO_REUSEPORT, &on,
+                     sizeof(on));
+        }
+#endif
+        acc->bind(ep);
+        acc->listen();
+        acceptors.push_back(move(acc));
+      }
+      bound = ep;
+      listening = true;
+    } catch (system_error&) {
+      cb(false);
+      return;
+    }
+    cb(true);
+
+    for (size_t i = 0; i < acceptors.size(); i++) {
+      for (int j = 0; j < pendingAccepts; j++)
+        accept(*acceptors[i], *loops[i]);
+    }
+
+    if (threads > 0) {
+      for (auto& l : loops)
+        l->thread = std::thread([&ctx = l->ctx] { ctx.run(); });
+    }
+  }
+
+  void stop() {
+    setWorkerPool(0);
+    for (auto& l : loops) {
+      l->ctx.stop();
+      if (l->thread.joinable())
+        l->thread.join();
+    }
+    if (std::exchange(listening, false))
+      imp::removeSocketFile(bound);
   }
 
-  struct Session : AsioPeer {
-    SessionID sid;
-    shared_ptr<tcp::socket> sock;
+  struct Session : Peer {
+    SessionID sid = -1;
+    int slot;
+    SessionID generation = 0;
+    bool closed = true;
+    // in freeSessions, or never handed out.
+    bool pooled = true;
+    Socket sock;
     MemOStream os;
-    AsioServer* server;
+    BasicAsioServer* server;
 
-    tcp::socket* getSocket() override { return sock.get(); }
+    Session(BasicAsioServer* s, io_context& ctx, int slot)
+        : slot(slot), sock(ctx), server(s) {}
+    Socket* getSocket() override { return &sock; }
     void onError(const error_code& err) override { server->onError(err, this); }
+    void onWritable(bool w) override { server->onWritable(w, this); }
+    // notifies keep queueing while a Block'ed session's reads are paused.
+    void onOverLimit() override { server->close(this); }
+    void onIdle() override {
+      if (closed)
+        server->close(this);
+    }
   };
 
   void onError(const error_code& err, Session* s) {
-    printf("%s\n", err.message().c_str());
+    // what was in flight on a session closed here fails too, often with
+    // EBADF rather than operation_aborted.
+    if (!s->closed && err != asio::error::eof &&
+        err != asio::error::operation_aborted)
+      printf("%s\n", err.message().c_str());
+    close(s);
+  }
+
+  void onWritable(bool w, Session* s) {
+    if (s->closed)
+      return;
+    if (overflow == Overflow::Disconnect && !w) {
+      close(s);
+      return;
+    }
+    if (overflow == Overflow::Block)
+      w ? s->resumeReceive() : s->pauseReceive();
+    sessionWritable(s->sid, w);
+  }
+
+  void close(Session* s) {
+    if (!s->closed) {
+      s->closed = true;
+      error_code ec;
+      s->sock.close(ec);
+      removeSession(s->sid);
+    }
+    // the session is reused only after its last read or write completed,
+    // from onIdle() if that is later.
+    if (s->idle() && !s->pooled) {
+      s->pooled = true;
+      s->resetPeer();
+      s->os.reset();
+      loopOf(s->sid).freeSessions.push_back(s);
+    }
+  }
+
+  void update() {
+    if (!loops.empty() && !loops[0]->thread.joinable())
+      loops[0]->ctx.poll();
   }
-  void update() { ctx.poll(); }
 
  private:
-  asio::io_context ctx;
-  map<SessionID, Session> sessions;
-  SessionID sessionID = 100;
-  unique_ptr<tcp::acceptor> acc;
+  // sid = (generation * MaxSessionsPerLoop + slot) * loops + loop, so
+  // sid % loops finds the loop, the slot indexes its session table and a
+  // reused slot never hands out the sid of the connection it served before
+  // (not until it was reused 2^47 / loops times).
+  static constexpr int MaxSessionsPerLoop = 1 << 16;
+  static constexpr std::chrono::milliseconds AcceptRetry{100};
+
+  struct Loop {
+    int index = 0;
+    int nextLoop = 0;
+    asio::io_context ctx;
+    executor_work_guard<io_context::executor_type> work = make_work_guard(ctx);
+    vector<unique_ptr<Session>> sessions;
+    vector<Session*> freeSessions;
+    std::thread thread;
+  };
+
+  Loop& loopOf(SessionID sid) { return *loops[sid % loops.size()]; }
+
+  Session* findSession(SessionID sid) {
+    auto& l = loopOf(sid);
+    size_t slot = sid / loops.size() % MaxSessionsPerLoop;
+    if (slot >= l.sessions.size())
+      return nullptr;
+    auto s = l.sessions[slot].get();
+    return s->sid == sid && !s->closed ? s : nullptr;
+  }
+
+  Session* newSession(Loop& l) {
+    if (l.sessions.size() >= MaxSessionsPerLoop)
+      return nullptr;
+    l.sessions.push_back(make_unique<Session>(this, l.ctx, l.sessions.size()));
+    return l.sessions.back().get();
+  }
+
+  void accept(Acceptor& acc, Loop& owner) {
+    // one acceptor for all loops deals connections out round-robin.
+    auto& l =
+        acceptorPerLoop ? owner : *loops[owner.nextLoop++ % loops.size()];
+    acc.async_accept(
+        l.ctx, [this, &acc, &owner, &l](const error_code& err,
+                                        Socket sock) {
+          if (err == asio::error::operation_aborted)
+            return;
+          if (err) {
+            // out of descriptors (EMFILE, ENFILE) won't clear up right away.
+            printf("accept: %s\n", err.message().c_str());
+            auto t = make_shared<steady_timer>(owner.ctx, AcceptRetry);
+            t->async_wait([this, &acc, &owner, t](const error_code& e) {
+              if (!e)
+                accept(acc, owner);
+            });
+            return;
+          }
+          asio::post(l.ctx, [this, &l, sock = move(sock)]() mutable {
+            open(l, move(sock));
+          });
+          accept(acc, owner);
+        });
+  }
+
+  void open(Loop& l, Socket sock) {
+    Session* s;
+    if (!l.freeSessions.empty()) {
+      s = l.freeSessions.back();
+      l.freeSessions.pop_back();
+    } else if (!(s = newSession(l))) {
+      return;
+    }
+    s->pooled = false;
+    auto maxGeneration = INT64_MAX / MaxSessionsPerLoop / loops.size();
+    s->generation = (s->generation + 1) % maxGeneration;
+    s->sid = (s->generation * MaxSessionsPerLoop + s->slot) *
+                 (SessionID)loops.size() +
+             l.index;
+    s->sock = move(sock);
+    s->noDelay();
+    s->closed = false;
+    s->batching = batching;
+    s->watermarks = watermarks;
+    s->compression = compression;
+    s->setMaxFrame(maxFrame);
+    s->os.setCodec(codec);
+    addSession(s->sid, s->os);
+    s->receive([this, sid = s->sid](MemIStream& in) { onReceive(sid, in); });
+  }
+
+  vector<unique_ptr<Loop>> loops;
+  vector<unique_ptr<Acceptor>> acceptors;
+  Endpoint bound;
+  bool listening = false;
+  bool acceptorPerLoop = false;
 };
 
+using AsioClient = BasicAsioClient<tcp>;
+using AsioServer = BasicAsioServer<tcp>;
+#ifdef ASIO_HAS_LOCAL_SOCKETS
+using UnixClient = BasicAsioClient<local::stream_protocol>;
+using UnixServer = BasicAsioServer<local::stream_protocol>;
+#endif
+
 template <typename Handler>
 using AsioRpcHandler = RpcHandler<Handler, MemIStream, MemOStream>;
 
@@ -0,0 +1,978 @@
+#include "asioTRpc.h"
+#include "shmTRpc.h"
+#include "uringTRpc.h"
+
+#include <assert.h>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <sstream>
+#include <thread>
+
+#include "histogram.h"
+
+using namespace trpc;
+using Clock = std::chrono::steady_clock;
+
+// heap allocations, to report them per call.
+std::atomic<size_t> allocs{0};
+
+// GCC sees the free() of these inlined into deletes of memory it thinks
+// came from operator new, not malloc().
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+void* operator new(size_t n) {
+  allocs.fetch_add(1, std::memory_order_relaxed);
+  if (auto p = malloc(n ? n : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept {
+  free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+  free(p);
+}
+#if defined(__GNUC__) && !defined(__clang__) && __GNUC__ >= 11
+#pragma GCC diagnostic pop
+#endif
+
+int port = 9990;
+
+//////////////////////////////////////////////////////////////////////////
+// results
+
+// One run: what was measured with which parameters. Printed when it
+// completes and kept for the JSON report.
+struct Result {
+  struct Field {
+    string name, value;
+    bool quoted;
+  };
+  string bench;
+  vector<Field> params;
+  vector<pair<string, double>> values;
+
+  Result(string b) : bench(b) {}
+  Result& param(const char* k, const string& v) {
+    params.push_back({k, v, true});
+    return *this;
+  }
+  Result& param(const char* k, long long v) {
+    params.push_back({k, std::to_string(v), false});
+    return *this;
+  }
+  Result& value(const char* k, double v) {
+    values.push_back({k, v});
+    return *this;
+  }
+};
+
+vector<Result> results;
+
+string formatValue(double v) {
+  char buf[32];
+  snprintf(buf, sizeof(buf), v == (long long)v ? "%.0f" : "%.3f", v);
+  return buf;
+}
+
+void report(const Result& r) {
+  printf("%s", r.bench.c_str());
+  for (auto& p : r.params)
+    printf(" %s=%s", p.name.c_str(), p.value.c_str());
+  printf(":");
+  for (auto& v : r.values)
+    printf(" %s=%s", v.first.c_str(), formatValue(v.second).c_str());
+  printf("\n");
+  fflush(stdout);
+  results.push_back(r);
+}
+
+void writeJson(FILE* f) {
+  fprintf(f, "[\n");
+  for (size_t i = 0; i < results.size(); i++) {
+    auto& r = results[i];
+    fprintf(f, "  {\"bench\": \"%s\", \"params\": {", r.bench.c_str());
+    for (size_t j = 0; j < r.params.size(); j++) {
+      auto& p = r.params[j];
+      fprintf(f, p.quoted ? "%s\"%s\": \"%s\"" : "%s\"%s\": %s",
+              j ? ", " : "", p.name.c_str(), p.value.c_str());
+    }
+    fprintf(f, "}, \"results\": {");
+    for (size_t j = 0; j < r.values.size(); j++)
+      fprintf(f, "%s\"%s\": %s", j ? ", " : "", r.values[j].first.c_str(),
+              formatValue(r.values[j].second).c_str());
+    fprintf(f, "}}%s\n", i + 1 < results.size() ? "," : "");
+  }
+  fprintf(f, "]\n");
+}
+
+const char* codecName(Codec c) {
+  return c == Codec::Compact ? "compact" : "raw";
+}
+
+class BenchHandler : public AsioRpcHandler<BenchHandler> {
+ public:
+  BenchHandler() : RpcHandler("Bench") {}
+
+  TRPC(add)
+  void add(SessionID, int a, int b, RespCb<int> cb) { cb(a + b); }
+
+  TRPC(sum)
+  void sum(SessionID, vector<double> v, RespCb<double> cb) {
+    double r = 0;
+    for (auto d : v)
+      r += d;
+    cb(r);
+  }
+};
+
+// Connection churn: `concurrency` clients keep connecting to the server and
+// hanging up right away until the server has seen `total` sessions close.
+void benchConnect(int threads, bool reusePort, int total, int concurrency) {
+  AsioServer s;
+  s.reusePort = reusePort;
+  s.sessionPoolSize = concurrency;
+  atomic<int> closed{0};
+  s.disconnected = [&](SessionID) { closed++; };
+  s.start(++port, [](bool ok) { assert(ok); }, threads);
+
+  io_context ctx;
+  tcp::endpoint ep(ip::address_v4::loopback(), port);
+  int started = 0;
+  Action<> connectOne = [&] {
+    if (started >= total)
+      return;
+    started++;
+    auto sock = make_shared<tcp::socket>(ctx);
+    sock->async_connect(ep, [&, sock](const error_code& err) {
+      if (err)
+        started--;
+      error_code ec;
+      sock->close(ec);
+      connectOne();
+    });
+  };
+
+  auto begin = Clock::now();
+  for (int i = 0; i < concurrency; i++)
+    connectOne();
+  while (closed < total) {
+    ctx.poll();
+    s.update();
+  }
+  std::chrono::duration<double> secs = Clock::now() - begin;
+
+  report(Result("connect")
+             .param("threads", threads)
+             .param("reusePort", reusePort)
+             .param("conns", total)
+             .param("concurrency", concurrency)
+             .value("connsPerSec", total / secs.count()));
+}
+
+// Pipelined calls: keep `depth` calls in flight until `total` completed.
+void benchCalls(bool batching, Codec codec, int depth, int total) {
+  AsioServer s;
+  s.addHandlers({new BenchHandler});
+  s.batching.enabled = batching;
+  s.codec = codec;
+  s.start(++port, [](bool ok) { assert(ok); });
+
+  AsioClient c;
+  c.batching.enabled = batching;
+  c.setCodec(codec);
+  int sent = 0, done = 0;
+  Action<> callOne = [&] {
+    if (sent >= total)
+      return;
+    sent++;
+    c.call("Bench.add", 1, 2, [&](int) {
+      done++;
+      callOne();
+    });
+  };
+
+  auto begin = Clock::now();
+  size_t allocsBefore = 0;
+  c.connect("127.0.0.1", port, [&](bool ok) {
+    assert(ok);
+    allocsBefore = allocs;
+    for (int i = 0; i < depth; i++)
+      callOne();
+  });
+  while (done < total) {
+    s.update();
+    c.update();
+  }
+  std::chrono::duration<double> secs = Clock::now() - begin;
+
+  report(Result("calls")
+             .param("batching", batching)
+             .param("codec", codecName(codec))
+             .param("depth", depth)
+             .value("callsPerSec", total / secs.count())
+             .value("writesPerCall", (double)c.stats.writes / total)
+             .value("bytesPerCall", (double)c.stats.bytes / total)
+             .value("allocsPerCall", (double)(allocs - allocsBefore) / total));
+}
+
+// Calls sending `n` doubles, `depth` in flight, with client frames of
+// `threshold` bytes and more compressed. `repetitive` values are like price
+// levels, the others don't compress.
+void benchCompression(size_t threshold, bool repetitive, int n, int total) {
+  AsioServer s;
+  s.addHandlers({new BenchHandler});
+  s.start(++port, [](bool ok) { assert(ok); });
+
+  AsioClient c;
+  c.compression.threshold = threshold;
+  vector<double> v(n);
+  for (int i = 0; i < n; i++)
+    v[i] = repetitive ? 100 + (i % 40) * 0.25 : sin(i) * 1e6;
+  int sent = 0, done = 0;
+  Action<> callOne = [&] {
+    if (sent >= total)
+      return;
+    sent++;
+    c.call("Bench.sum", v, [&](double) {
+      done++;
+      callOne();
+    });
+  };
+
+  auto begin = Clock::now();
+  c.connect("127.0.0.1", port, [&](bool ok) {
+    assert(ok);
+    for (int i = 0; i < 8; i++)
+      callOne();
+  });
+  while (done < total) {
+    s.update();
+    c.update();
+  }
+  std::chrono::duration<double> secs = Clock::now() - begin;
+
+  report(Result("compression")
+             .param("threshold", (long long)threshold)
+             .param("values", repetitive ? "repetitive" : "noisy")
+             .param("n", n)
+             .value("callsPerSec", total / secs.count())
+             .value("bytesPerCall", (double)c.stats.bytes / total)
+             .value("compressedFrames",
+                    (double)c.stats.compressed /
+                        std::max<size_t>(1, c.stats.frames)));
+}
+
+// A notify of `payload` bytes to `clients` sessions, `rounds` times, with
+// broadcast() encoding it once or, without the transport's shared frames,
+// for every session. `sendUs` is the time spent in broadcast() itself.
+void benchFanout(bool shared, int clients, int payload, int rounds) {
+  AsioServer s;
+  s.addHandlers({new BenchHandler});
+  s.start(++port, [](bool ok) { assert(ok); });
+  if (!shared) {
+    s.encodeFrame = nullptr;
+    s.sendFrame = nullptr;
+  }
+
+  vector<unique_ptr<AsioClient>> cs;
+  int joined = 0, received = 0;
+  for (int i = 0; i < clients; i++) {
+    cs.push_back(make_unique<AsioClient>());
+    auto c = cs.back().get();
+    c->onNotify("tick", [&](int, string) { received++; });
+    c->connect("127.0.0.1", port, [&, c](bool ok) {
+      assert(ok);
+      c->call("Bench.add", 1, 2, [&](int) { joined++; });
+    });
+  }
+  auto pump = [&] {
+    s.update();
+    for (auto& c : cs)
+      c->update();
+  };
+  while (joined < clients)
+    pump();
+
+  string data(payload, 'x');
+  std::chrono::duration<double> sending{0};
+  size_t allocsSending = 0;
+  auto begin = Clock::now();
+  for (int r = 0; r < rounds; r++) {
+    auto allocsBefore = allocs.load();
+    auto sendBegin = Clock::now();
+    s.broadcast("tick", r, data);
+    sending += Clock::now() - sendBegin;
+    allocsSending += allocs - allocsBefore;
+    while (received < (r + 1) * clients)
+      pump();
+  }
+  std::chrono::duration<double> secs = Clock::now() - begin;
+
+  report(Result("fanout")
+             .param("shared", shared)
+             .param("clients", clients)
+             .param("payload", payload)
+             .value("sendUs", sending.count() * 1e6 / rounds)
+             .value("allocsPerSend", (double)allocsSending / rounds)
+             .value("notifiesPerSec", (double)rounds * clients / secs.count()));
+}
+
+#ifdef TRPC_COROUTINES
+// Same as benchCalls() without batching, with `depth` coroutines awaiting
+// calls in a loop instead of callbacks.
+Task<> awaitCalls(AsioClient& c, int& sent, int& done, int total) {
+  while (sent < total) {
+    sent++;
+    int r = co_await c.call<int>("Bench.add", 1, 2);
+    assert(r == 3);
+    done++;
+  }
+}
+
+void benchAwait(int depth, int total) {
+  AsioServer s;
+  s.addHandlers({new BenchHandler});
+  s.start(++port, [](bool ok) { assert(ok); });
+
+  AsioClient c;
+  int sent = 0, done = 0;
+  auto begin = Clock::now();
+  size_t allocsBefore = 0;
+  c.connect("127.0.0.1", port, [&](bool ok) {
+    assert(ok);
+    allocsBefore = allocs;
+    for (int i = 0; i < depth; i++)
+      awaitCalls(c, sent, done, total);
+  });
+  while (done < total) {
+    s.update();
+    c.update();
+  }
+  std::chrono::duration<double> secs = Clock::now() - begin;
+
+  report(Result("await")
+             .param("depth", depth)
+             .value("callsPerSec", total / secs.count())
+             .value("allocsPerCall", (double)(allocs - allocsBefore) / total));
+}
+#endif
+
+// Encode and decode vector<T> of `n` elements until ~100M elements passed.
+template <typename T>
+void benchVector(const char* type, Codec codec, size_t n) {
+  vector<T> v(n), r;
+  for (size_t i = 0; i < n; i++)
+    v[i] = (T)i;
+  auto rounds = std::max<size_t>(1, 100000000 / n);
+  MemOStream o;
+  o.setCodec(codec);
+
+  std::chrono::duration<double> encode{0}, decode{0};
+  for (size_t i = 0; i < rounds; i++) {
+    o.reset();
+    auto begin = Clock::now();
+    o << v;
+    encode += Clock::now() - begin;
+
+    MemIStream in(o.data(), o.getSize(), codec);
+    begin = Clock::now();
+    in >> r;
+    decode += Clock::now() - begin;
+  }
+  assert(r == v);
+
+  auto mb = (double)rounds * n * sizeof(T) / 1e6;
+  report(Result("vector")
+             .param("type", type)
+             .param("codec", codecName(codec))
+             .param("n", (long long)n)
+             .value("encodeMBPerSec", mb / encode.count())
+             .value("decodeMBPerSec", mb / decode.count()));
+}
+
+// Pending request bookkeeping alone: `inFlight` requests outstanding, each
+// answered one is replaced by a new one, as with the old map<int, function>
+// and with RequestTable.
+void benchPending(int inFlight) {
+  const int total = 2000000;
+  int answered = 0;
+  auto cb = [&answered, pad = array<int64_t, 4>{}](MemIStream&) {
+    answered += 1 + (int)pad[0];
+  };
+  MemIStream in;
+
+  map<int, function<void(MemIStream&)>> old;
+  int next = 0;
+  auto begin = Clock::now();
+  for (int i = 0; i < inFlight; i++)
+    old[next++] = cb;
+  for (int i = 0; i < total; i++) {
+    auto it = old.find(i);
+    auto f = std::move(it->second);
+    old.erase(it);
+    f(in);
+    old[next++] = cb;
+  }
+  std::chrono::duration<double> mapTime = Clock::now() - begin;
+
+  RequestTable<SmallFunction<void(MemIStream&)>> table{0};
+  vector<int> ids;
+  begin = Clock::now();
+  for (int i = 0; i < inFlight; i++)
+    ids.push_back(table.add(cb));
+  for (int i = 0; i < total; i++) {
+    auto& id = ids[i % inFlight];
+    table.take(id)(in);
+    id = table.add(cb);
+  }
+  std::chrono::duration<double> tableTime = Clock::now() - begin;
+
+  // the same with every request on the timing wheel, expired every tick.
+  RequestTable<SmallFunction<void(MemIStream&)>> timed{0};
+  auto deadline = Clock::now() + std::chrono::seconds(30);
+  auto nextTick = Clock::now();
+  ids.clear();
+  begin = Clock::now();
+  for (int i = 0; i < inFlight; i++)
+    ids.push_back(timed.add(cb, deadline));
+  for (int i = 0; i < total; i++) {
+    auto& id = ids[i % inFlight];
+    timed.take(id)(in);
+    id = timed.add(cb, deadline);
+    if (!(i & 1023) && Clock::now() >= nextTick) {
+      timed.expire(Clock::now(), [](auto&) { assert(false); });
+      nextTick += TimerTick;
+    }
+  }
+  std::chrono::duration<double> timedTime = Clock::now() - begin;
+  assert(answered == 3 * total);
+
+  report(Result("pending")
+             .param("inFlight", inFlight)
+             .value("mapNsPerCall", mapTime.count() * 1e9 / total)
+             .value("tableNsPerCall", tableTime.count() * 1e9 / total)
+             .value("deadlinesNsPerCall", timedTime.count() * 1e9 / total));
+}
+
+// same fields, once with hand-written operators and once left to the
+// built-in aggregate serialization.
+struct Tick {
+  int64_t time;
+  int32_t id;
+  float bid, ask;
+  uint32_t size;
+  double last;
+};
+
+struct HandTick {
+  int64_t time;
+  int32_t id;
+  float bid, ask;
+  uint32_t size;
+  double last;
+};
+
+bool operator<<(MemOStream& o, const HandTick& t) {
+  o << t.time;
+  o << t.id;
+  o << t.bid;
+  o << t.ask;
+  o << t.size;
+  return o << t.last;
+}
+
+bool operator>>(MemIStream& i, HandTick& t) {
+  return (i >> t.time) && (i >> t.id) && (i >> t.bid) && (i >> t.ask) &&
+         (i >> t.size) && (i >> t.last);
+}
+
+template <typename T>
+void benchStruct(const char* type, Codec codec, size_t n) {
+  vector<T> v(n), r(n);
+  for (size_t i = 0; i < n; i++)
+    v[i] = T{(int64_t)i, (int32_t)i, 1.5f, 2.5f, (uint32_t)i, 0.25 * i};
+  MemOStream o;
+  o.setCodec(codec);
+
+  std::chrono::duration<double> encode{0}, decode{0};
+  for (int round = 0; round < 20; round++) {
+    o.reset();
+    auto begin = Clock::now();
+    for (auto& t : v)
+      o << t;
+    encode += Clock::now() - begin;
+
+    MemIStream in(o.data(), o.getSize(), codec);
+    begin = Clock::now();
+    for (auto& t : r)
+      in >> t;
+    decode += Clock::now() - begin;
+  }
+  assert(r.back().last == v.back().last && r.back().id == v.back().id);
+
+  auto m = 20.0 * n / 1e6;
+  report(Result("struct")
+             .param("type", type)
+             .param("codec", codecName(codec))
+             .value("encodeMPerSec", m / encode.count())
+             .value("decodeMPerSec", m / decode.count()));
+}
+
+//////////////////////////////////////////////////////////////////////////
+// round-trip latency
+
+// std::iostream with values separated by spaces, as in example.cpp.
+class TextStream : public std::stringstream {};
+
+template <typename T>
+TextStream& operator<<(TextStream& s, const T& v) {
+  static_cast<std::ostream&>(s) << v << ' ';
+  return s;
+}
+
+template <typename istream, typename ostream = istream>
+class EchoHandler
+    : public RpcHandler<EchoHandler<istream, ostream>, istream, ostream> {
+  using Base = RpcHandler<EchoHandler, istream, ostream>;
+  using typename Base::Reg;
+  using typename Base::Sub;
+
+ public:
+  EchoHandler() : Base("Bench") {}
+
+  TRPC(echo)
+  void echo(SessionID, string s, RespCb<string> cb) { cb(s); }
+};
+
+enum class Transport { Stream, Mem, Asio, Unix, Shm, Uring };
+
+const char* transportName(Transport t) {
+  const char* names[] = {"iostream", "mem", "asio", "unix", "shm", "uring"};
+  return names[(int)t];
+}
+
+// Echo calls of `payload` bytes, `depth` of them kept in flight on every
+// client, until `total` completed. Each round trip is timed from call() to
+// its callback.
+struct Load {
+  string payload;
+  int depth, total;
+  int sent = 0, done = 0;
+  Histogram rtt;
+
+  template <typename Client>
+  void callOne(Client& c) {
+    if (sent >= total)
+      return;
+    sent++;
+    auto begin = Clock::now();
+    c.call("Bench.echo", string_view(payload), [this, &c, begin](string r) {
+      rtt.record((Clock::now() - begin).count());
+      assert(r.size() == payload.size());
+      done++;
+      callOne(c);
+    });
+  }
+
+  template <typename Client>
+  void start(Client& c) {
+    for (int i = 0; i < depth; i++)
+      callOne(c);
+  }
+};
+
+// In-process transports hand bytes over in a polling loop rather than from
+// flush(), so a callback making the next call doesn't recurse.
+size_t runStream(Load& load, int clients) {
+  RpcServer<TextStream> server;
+  server.addHandlers({new EchoHandler<TextStream>});
+  server.flush = [](SessionID) {};
+  vector<TextStream> up(clients), down(clients);
+  vector<unique_ptr<RpcClient<TextStream>>> cs;
+  for (int i = 0; i < clients; i++) {
+    server.addSession(i, down[i]);
+    cs.push_back(make_unique<RpcClient<TextStream>>(up[i]));
+    cs.back()->flush = [] {};
+  }
+
+  size_t bytes = 0;
+  for (auto& c : cs)
+    load.start(*c);
+  while (load.done < load.total) {
+    for (int i = 0; i < clients; i++) {
+      if (up[i].rdbuf()->in_avail() > 0) {
+        bytes += (size_t)up[i].tellp();
+        server.onReceive(i, up[i]);
+        up[i].str("");
+        up[i].clear();
+      }
+      if (down[i].rdbuf()->in_avail() > 0) {
+        cs[i]->onReceive(down[i]);
+        down[i].str("");
+        down[i].clear();
+      }
+    }
+  }
+  return bytes;
+}
+
+size_t runMem(Load& load, int clients, Codec codec) {
+  using Client = RpcClient<MemIStream, MemOStream>;
+  RpcServer<MemIStream, MemOStream> server;
+  server.addHandlers({new EchoHandler<MemIStream, MemOStream>});
+  server.flush = [](SessionID) {};
+  vector<MemOStream> up(clients), down(clients);
+  vector<unique_ptr<Client>> cs;
+  for (int i = 0; i < clients; i++) {
+    up[i].setCodec(codec);
+    down[i].setCodec(codec);
+    server.addSession(i, down[i]);
+    cs.push_back(make_unique<Client>(up[i]));
+    cs.back()->flush = [] {};
+  }
+
+  size_t bytes = 0;
+  string frame;
+  for (auto& c : cs)
+    load.start(*c);
+  while (load.done < load.total) {
+    for (int i = 0; i < clients; i++) {
+      if (up[i].getSize()) {
+        up[i].swap(frame);
+        bytes += frame.size();
+        MemIStream in(frame.data(), frame.size(), codec);
+        server.onReceive(i, in);
+      }
+      if (down[i].getSize()) {
+        down[i].swap(frame);
+        MemIStream in(frame.data(), frame.size(), codec);
+        cs[i]->onReceive(in);
+      }
+    }
+  }
+  return bytes;
+}
+
+// TCP over loopback or a Unix domain socket, by the type of `ep`.
+template <typename Protocol>
+size_t runAsio(Load& load,
+               int clients,
+               Codec codec,
+               const typename Protocol::endpoint& ep) {
+  BasicAsioServer<Protocol> s;
+  s.addHandlers({new EchoHandler<MemIStream, MemOStream>});
+  s.codec = codec;
+  s.start(ep, [](bool ok) { assert(ok); });
+
+  vector<unique_ptr<BasicAsioClient<Protocol>>> cs;
+  int connected = 0;
+  for (int i = 0; i < clients; i++) {
+    cs.push_back(make_unique<BasicAsioClient<Protocol>>());
+    auto& c = *cs.back();
+    c.setCodec(codec);
+    c.connect(ep, [&](bool ok) {
+      assert(ok);
+      connected++;
+    });
+  }
+  while (connected < clients) {
+    s.update();
+    for (auto& c : cs)
+      c->update();
+  }
+
+  for (auto& c : cs)
+    load.start(*c);
+  while (load.done < load.total) {
+    s.update();
+    for (auto& c : cs)
+      c->update();
+  }
+  size_t bytes = 0;
+  for (auto& c : cs)
+    bytes += c->stats.bytes;
+  return bytes;
+}
+
+#ifdef TRPC_SHM
+size_t runShm(Load& load, int clients, Codec codec) {
+  ShmServer s;
+  s.addHandlers({new EchoHandler<MemIStream, MemOStream>});
+  s.codec = codec;
+  s.ringBytes = std::max<size_t>(s.ringBytes, load.payload.size() * 4);
+  auto name = "/trpcBench" + std::to_string(getpid());
+  auto ok = s.listen(name);
+  assert(ok);
+
+  vector<unique_ptr<ShmClient>> cs;
+  for (int i = 0; i < clients; i++) {
+    cs.push_back(make_unique<ShmClient>());
+    cs.back()->setCodec(codec);
+    ok = cs.back()->connect(name);
+    assert(ok);
+  }
+  s.update();
+
+  for (auto& c : cs)
+    load.start(*c);
+  while (load.done < load.total) {
+    s.update();
+    for (auto& c : cs)
+      c->update();
+  }
+  size_t bytes = 0;
+  for (auto& c : cs)
+    bytes += c->stats.bytes;
+  return bytes;
+}
+#endif
+
+#ifdef TRPC_URING
+// Both ends on io_uring, `syscalls` counts the io_uring_enter calls made.
+size_t runUring(Load& load, int clients, Codec codec, size_t& syscalls) {
+  UringServer s;
+  s.addHandlers({new EchoHandler<MemIStream, MemOStream>});
+  s.codec = codec;
+  auto p = ++port;
+  s.start(p, [](bool ok) { assert(ok); });
+
+  vector<unique_ptr<UringClient>> cs;
+  int connected = 0;
+  for (int i = 0; i < clients; i++) {
+    cs.push_back(make_unique<UringClient>());
+    auto& c = *cs.back();
+    // a slot per connection is plenty on the client side.
+    c.options.fixedSlots = 1;
+    c.setCodec(codec);
+    c.connect("127.0.0.1", p, [&](bool ok) {
+      assert(ok);
+      connected++;
+    });
+  }
+  while (connected < clients) {
+    s.update();
+    for (auto& c : cs)
+      c->update();
+  }
+
+  size_t enters = s.enters();
+  for (auto& c : cs)
+    enters += c->enters();
+  for (auto& c : cs)
+    load.start(*c);
+  while (load.done < load.total) {
+    s.update();
+    for (auto& c : cs)
+      c->update();
+  }
+  size_t bytes = 0;
+  syscalls = s.enters() - enters;
+  for (auto& c : cs) {
+    bytes += c->stats.bytes;
+    syscalls += c->enters();
+  }
+  return bytes;
+}
+#endif
+
+void benchLatency(Transport t,
+                  Codec codec,
+                  size_t payload,
+                  int depth,
+                  int clients,
+                  int total) {
+  Load load{string(payload, 'x'), depth, total, 0, 0, Histogram()};
+  auto begin = Clock::now();
+  size_t bytes = 0, syscalls = 0;
+  switch (t) {
+    case Transport::Stream:
+      bytes = runStream(load, clients);
+      break;
+    case Transport::Mem:
+      bytes = runMem(load, clients, codec);
+      break;
+    case Transport::Asio:
+      bytes =
+          runAsio<tcp>(load, clients, codec,
+                       {ip::address_v4::loopback(), (unsigned short)++port});
+      break;
+    case Transport::Unix:
+#ifdef ASIO_HAS_LOCAL_SOCKETS
+      bytes = runAsio<local::stream_protocol>(
+          load, clients, codec,
+          "/tmp/trpcBench" + std::to_string(getpid()) + ".sock");
+#endif
+      break;
+    case Transport::Shm:
+#ifdef TRPC_SHM
+      bytes = runShm(load, clients, codec);
+#endif
+      break;
+    case Transport::Uring:
+#ifdef TRPC_URING
+      bytes = runUring(load, clients, codec, syscalls);
+#endif
+      break;
+  }
+  std::chrono::duration<double> secs = Clock::now() - begin;
+
+  auto us = [&](double p) { return load.rtt.percentile(p) / 1e3; };
+  auto r = Result("latency")
+               .param("transport", transportName(t))
+               .param("codec",
+                      t == Transport::Stream ? "text" : codecName(codec))
+               .param("payload", (long long)payload)
+               .param("depth", depth)
+               .param("clients", clients)
+               .param("calls", total)
+               .value("callsPerSec", total / secs.count())
+               .value("bytesPerCall", (double)bytes / total)
+               .value("p50Us", us(50))
+               .value("p99Us", us(99))
+               .value("p999Us", us(99.9))
+               .value("maxUs", load.rtt.max() / 1e3);
+  if (t == Transport::Uring)
+    r.value("syscallsPerCall", (double)syscalls / total);
+  report(r);
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+vector<int> listArg(const char* s) {
+  vector<int> r;
+  std::stringstream ss(s);
+  string item;
+  while (std::getline(ss, item, ','))
+    r.push_back(std::stoi(item));
+  return r;
+}
+
+void usage() {
+  puts(
+      "usage: asioTRpcBench [--json FILE] [--only BENCH,...]\n"
+      "                     [--payload N,...] [--depth N,...] "
+      "[--clients N,...] [--calls N]\n"
+      "benches: connect calls await pending vector struct latency "
+      "compression fanout");
+}
+
+int main(int argc, char* argv[]) {
+  const char* json = nullptr;
+  string only;
+  vector<int> payloads{16, 1024, 16384}, depths{1, 32}, clientCounts{1, 8};
+  int calls = 50000;
+  for (int i = 1; i < argc; i++) {
+    string a = argv[i];
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+    const char* v = argv[++i];
+    if (a == "--json")
+      json = v;
+    else if (a == "--only")
+      only = string(",") + v + ",";
+    else if (a == "--payload")
+      payloads = listArg(v);
+    else if (a == "--depth")
+      depths = listArg(v);
+    else if (a == "--clients")
+      clientCounts = listArg(v);
+    else if (a == "--calls")
+      calls = std::stoi(v);
+    else {
+      usage();
+      return 1;
+    }
+  }
+  auto enabled = [&](const char* bench) {
+    return only.empty() || only.find(string(",") + bench + ",") != string::npos;
+  };
+
+  int cores = std::max(1u, std::thread::hardware_concurrency());
+  if (enabled("connect")) {
+    benchConnect(0, false, 10000, 64);
+    benchConnect(cores, false, 10000, 64);
+    benchConnect(cores, true, 10000, 64);
+  }
+  if (enabled("calls")) {
+    for (auto depth : {1, 20, 200}) {
+      benchCalls(false, Codec::Raw, depth, 200000);
+      benchCalls(true, Codec::Raw, depth, 200000);
+    }
+    benchCalls(true, Codec::Compact, 20, 200000);
+  }
+#ifdef TRPC_COROUTINES
+  if (enabled("await")) {
+    for (auto depth : {1, 20, 200})
+      benchAwait(depth, 200000);
+  }
+#endif
+  if (enabled("pending")) {
+    for (auto inFlight : {16, 1000, 50000, 1000000})
+      benchPending(inFlight);
+  }
+  if (enabled("vector")) {
+    for (size_t n = 10; n <= 10000000; n *= 10) {
+      benchVector<double>("double", Codec::Raw, n);
+      benchVector<int>("int", Codec::Raw, n);
+      benchVector<int>("int", Codec::Compact, n);
+    }
+  }
+  if (enabled("struct")) {
+    for (auto codec : {Codec::Raw, Codec::Compact}) {
+      benchStruct<HandTick>("hand-written", codec, 1000000);
+      benchStruct<Tick>("reflected", codec, 1000000);
+    }
+  }
+  if (enabled("compression")) {
+    for (auto repetitive : {true, false})
+      for (size_t threshold : {0, 1024})
+        benchCompression(threshold, repetitive, 1000, 20000);
+  }
+  if (enabled("fanout")) {
+    for (auto payload : {64, 16384})
+      for (auto shared : {false, true})
+        benchFanout(shared, 200, payload, 200);
+  }
+  if (enabled("latency")) {
+    const pair<Transport, Codec> configs[] = {
+        {Transport::Stream, Codec::Raw}, {Transport::Mem, Codec::Raw},
+        {Transport::Mem, Codec::Compact}, {Transport::Asio, Codec::Raw},
+        {Transport::Asio, Codec::Compact},
+#ifdef ASIO_HAS_LOCAL_SOCKETS
+        {Transport::Unix, Codec::Raw},    {Transport::Unix, Codec::Compact},
+#endif
+#ifdef TRPC_SHM
+        {Transport::Shm, Codec::Raw},     {Transport::Shm, Codec::Compact},
+#endif
+#ifdef TRPC_URING
+        {Transport::Uring, Codec::Raw},   {Transport::Uring, Codec::Compact},
+#endif
+    };
+    for (auto& [t, codec] : configs)
+      for (auto payload : payloads)
+        for (auto depth : depths)
+          for (auto clients : clientCounts) {
+            // ~500MB of payload per run at most.
+            auto total = std::max(
+                1000, std::min(calls, (int)(500000000 / std::max(1, payload))));
+            benchLatency(t, codec, payload, depth, clients, total);
+          }
+  }
+
+  if (json) {
+    auto f = fopen(json, "w");
+    if (!f) {
+      printf("can't write %s\n", json);
+      return 1;
+    }
+    writeJson(f);
+    fclose(f);
+  }
+  return 0;
+}
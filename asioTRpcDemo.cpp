@@ -1,5 +1,6 @@
 #include "asioTRpc.h"
 
+#include <algorithm>
 #include <assert.h>
 #include <chrono>
 #include <thread>
@@ -8,12 +9,12 @@ using namespace trpc;
 
 class MyHandler : public AsioRpcHandler<MyHandler> {
  public:
-  MyHandler() : RpcHandler("MyHandler") {}
+  MyHandler() : RpcHandler("MyHandler") { setCompress("bar"); }
 
   TRPC(foo)
   void foo(SessionID sid, int a, int b, RespCb<int> cb) { cb(a + b); }
 
-  TRPC(bar)
+  TRPC_POOLED(bar)
   void bar(SessionID sid, map<int, double> data, RespCb<vector<double>> cb) {
     vector<double> r;
     for (auto [k, v] : data) {
@@ -21,6 +22,27 @@ class MyHandler : public AsioRpcHandler<MyHandler> {
     }
     cb(r);
   }
+
+  // `text` points into the request frame, which stays pinned until the
+  // pooled call is done with it.
+  TRPC_POOLED(count)
+  void count(SessionID sid, string_view text, char c, RespCb<size_t> cb) {
+    cb(std::count(text.begin(), text.end(), c));
+  }
+
+  // streams the squares below n, as fast as the client takes them.
+  TRPC(squares)
+  void squares(SessionID sid, int n, Writer<int> w) {
+    auto i = make_shared<int>(0);
+    w.onReady([=]() mutable {
+      while (w.ready() && *i < n) {
+        w.write(*i * *i);
+        ++*i;
+      }
+      if (*i == n)
+        w.end();
+    });
+  }
 };
 
 bool quit = false;
@@ -38,7 +60,20 @@ void test(shared_ptr<AsioClient> c, int i, shared_ptr<Action<>> cb) {
     c->call("MyHandler.bar", d, [=](vector<double> r) {
       assert(r[0] == 1.1);
       assert(r[1] == 2.2);
-      (*cb)();
+      c->call("MyHandler.count", string(1000, 'x'), 'x', [=](size_t n) {
+        assert(n == 1000);
+        auto next = make_shared<int>(0);
+        c->stream(
+            "MyHandler.squares", 100,
+            [=](int sq) {
+              assert(sq == *next * *next);
+              ++*next;
+            },
+            [=](Status st, const string&) {
+              assert(st == Status::Ok && *next == 100);
+              (*cb)();
+            });
+      });
     });
   });
 }
@@ -48,11 +83,18 @@ int main() {
   auto c = make_shared<AsioClient>();
 
   s->addHandlers({new MyHandler});
+  s->setWorkerPool(2);
+  s->batching.enabled = true;
+  c->batching.enabled = true;
+  // count()'s text goes compressed.
+  c->compression.threshold = 512;
 
   int port = 9999;
   int cnt = 2000;
   s->start(port, [=](bool) {
     c->connect("127.0.0.1", port, [=](bool) {
+      c->resolve("MyHandler.foo");
+      c->resolve("MyHandler.bar");
       auto i = make_shared<int>(0);
       auto done = make_shared<Action<>>();
       *done = [=] {
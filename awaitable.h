@@ -0,0 +1,285 @@
+//////////////////////////////////////////////////////////////////////////
+// C++20 coroutine support: co_await client.call<R...>("H.f", args...)
+//
+// by soniced@sina.com.
+// All rights reserved.
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#if __has_include(<coroutine>) && defined(__cpp_impl_coroutine)
+#define TRPC_COROUTINES 1
+
+#include <coroutine>
+#include <cstdio>
+#include <exception>
+#include <optional>
+#include <stdexcept>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace trpc {
+
+// defined in trpc.h, Status() is Status::Ok.
+enum class Status;
+
+// thrown from co_await of a call that failed, unless its results start with
+// a Status.
+struct RpcError : std::runtime_error {
+  Status status;
+  RpcError(Status s) : std::runtime_error("rpc call failed"), status(s) {}
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+// Free lists of coroutine frames in 64-byte size classes, one set per
+// thread. A transport runs each connection on a single thread, so frames are
+// recycled by the connection that made them. Frames over MaxSize use the
+// global heap.
+class FramePool {
+ public:
+  static constexpr size_t Granularity = 64;
+  static constexpr size_t MaxSize = 2048;
+
+  static void* alloc(size_t n) {
+    if (n > MaxSize)
+      return ::operator new(n);
+    auto& list = lists()[classOf(n)];
+    if (list.empty())
+      return ::operator new(classOf(n) * Granularity + Granularity);
+    auto p = list.back();
+    list.pop_back();
+    return p;
+  }
+
+  static void free(void* p, size_t n) {
+    if (n > MaxSize) {
+      ::operator delete(p);
+      return;
+    }
+    lists()[classOf(n)].push_back(p);
+  }
+
+ private:
+  static size_t classOf(size_t n) { return (n - 1) / Granularity; }
+
+  struct Lists {
+    std::vector<void*> l[MaxSize / Granularity];
+    std::vector<void*>& operator[](size_t i) { return l[i]; }
+    ~Lists() {
+      for (auto& list : l)
+        for (auto p : list)
+          ::operator delete(p);
+    }
+  };
+  static Lists& lists() {
+    static thread_local Lists l;
+    return l;
+  }
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+// Eagerly started coroutine. Awaiting it resumes the awaiter when it
+// finishes. A Task dropped before it finishes keeps running and frees itself
+// at the end.
+template <typename T = void>
+class Task {
+ public:
+  struct promise_type;
+  using Handle = std::coroutine_handle<promise_type>;
+
+  struct PromiseBase {
+    std::coroutine_handle<> continuation;
+    std::exception_ptr error;
+    bool detached = false;
+
+    // an exception no one awaited the task for is reported, not lost.
+    ~PromiseBase() {
+      if (!error)
+        return;
+      try {
+        std::rethrow_exception(error);
+      } catch (const std::exception& e) {
+        printf("unhandled exception in task: %s\n", e.what());
+      } catch (...) {
+        printf("unhandled exception in task\n");
+      }
+    }
+
+    static void* operator new(size_t n) { return FramePool::alloc(n); }
+    static void operator delete(void* p, size_t n) { FramePool::free(p, n); }
+
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    auto final_suspend() noexcept {
+      struct Final {
+        bool await_ready() noexcept { return false; }
+        std::coroutine_handle<> await_suspend(Handle h) noexcept {
+          auto& p = h.promise();
+          if (p.continuation)
+            return p.continuation;
+          if (p.detached)
+            h.destroy();
+          return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+      };
+      return Final{};
+    }
+    void unhandled_exception() { error = std::current_exception(); }
+  };
+
+  struct promise_type : PromiseBase {
+    std::optional<T> value;
+    Task get_return_object() { return Task(Handle::from_promise(*this)); }
+    template <typename U>
+    void return_value(U&& v) {
+      value.emplace(std::forward<U>(v));
+    }
+    T result() {
+      if (this->error)
+        std::rethrow_exception(std::exchange(this->error, nullptr));
+      return std::move(*value);
+    }
+  };
+
+  Task(Task&& o) noexcept : h(std::exchange(o.h, {})) {}
+  Task& operator=(Task&& o) noexcept {
+    if (this != &o) {
+      release();
+      h = std::exchange(o.h, {});
+    }
+    return *this;
+  }
+  ~Task() { release(); }
+
+  bool done() const { return !h || h.done(); }
+
+  auto operator co_await() && noexcept {
+    struct Awaiter {
+      Handle h;
+      bool await_ready() noexcept { return h.done(); }
+      void await_suspend(std::coroutine_handle<> c) noexcept {
+        h.promise().continuation = c;
+      }
+      T await_resume() { return h.promise().result(); }
+    };
+    return Awaiter{h};
+  }
+
+ private:
+  explicit Task(Handle h) : h(h) {}
+
+  void release() {
+    if (!h)
+      return;
+    if (h.done())
+      h.destroy();
+    else
+      h.promise().detached = true;
+    h = {};
+  }
+
+  Handle h;
+};
+
+template <>
+struct Task<void>::promise_type : Task<void>::PromiseBase {
+  Task get_return_object() { return Task(Handle::from_promise(*this)); }
+  void return_void() {}
+  void result() {
+    if (this->error)
+      std::rethrow_exception(std::exchange(this->error, nullptr));
+  }
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+namespace imp {
+
+template <typename... R>
+constexpr bool starts_with_status_v = false;
+
+template <typename... R>
+constexpr bool starts_with_status_v<Status, R...> = true;
+
+template <typename... R>
+struct CallResult {
+  using Type = std::tuple<R...>;
+  static Type get(std::tuple<R...>& r) { return std::move(r); }
+};
+
+template <typename R>
+struct CallResult<R> {
+  using Type = R;
+  static Type get(std::tuple<R>& r) { return std::move(std::get<0>(r)); }
+};
+
+template <>
+struct CallResult<> {
+  using Type = void;
+  static void get(std::tuple<>&) {}
+};
+
+}  // namespace imp
+
+// Awaiter of a call giving results R... `launch(cb)` sends the call. The
+// response callback stores the results in here and resumes the awaiting
+// coroutine right away, from within the transport's onReceive, so the
+// only allocation is the awaiting coroutine's own pooled frame.
+template <typename Launch, typename... R>
+class CallAwaiter {
+ public:
+  CallAwaiter(Launch l) : launch(std::move(l)) {}
+
+  bool await_ready() noexcept { return false; }
+
+  bool await_suspend(std::coroutine_handle<> h) {
+    handle = h;
+    if constexpr (imp::starts_with_status_v<R...>) {
+      launch([this](R... r) { finish(Status(), std::move(r)...); });
+    } else {
+      launch([this](Status st, R... r) { finish(st, std::move(r)...); });
+    }
+    // the response may arrive before launch() returns.
+    if (completed)
+      return false;
+    suspended = true;
+    return true;
+  }
+
+  typename imp::CallResult<R...>::Type await_resume() {
+    if constexpr (!imp::starts_with_status_v<R...>) {
+      if (status != Status())
+        throw RpcError(status);
+    }
+    return imp::CallResult<R...>::get(*results);
+  }
+
+ private:
+  template <typename... A>
+  void finish(Status st, A&&... a) {
+    status = st;
+    results.emplace(std::forward<A>(a)...);
+    if (suspended)
+      handle.resume();
+    else
+      completed = true;
+  }
+
+  Launch launch;
+  std::coroutine_handle<> handle;
+  std::optional<std::tuple<R...>> results;
+  Status status{};
+  bool suspended = false;
+  bool completed = false;
+};
+
+template <typename... R, typename Launch>
+CallAwaiter<Launch, R...> makeCallAwaiter(Launch l) {
+  return CallAwaiter<Launch, R...>(std::move(l));
+}
+
+}  // namespace trpc
+
+#endif
@@ -85,6 +85,9 @@ using Ptr = shared_ptr<T>;
 
 class PromiseBase;
 
+// Runs promises when what they await settles. Nothing is polled: a promise is
+// queued when its sub-promise resolves or rejects, and updateAll() runs the
+// queue until it is empty.
 class Executor {
  public:
   static Executor*& instance() {
@@ -93,12 +96,42 @@ class Executor {
   }
   Executor() { instance() = this; }
   virtual ~Executor() { instance() = nullptr; }
+  // run the ready promises, return whether any promise is still in progress.
   virtual bool updateAll();
-  virtual void add(PromiseBase* i) { pool.push_back(i); }
-  virtual void remove(PromiseBase* i) { pool.remove(i); }
+  virtual void add(PromiseBase*) { inprogress++; }
+  virtual void remove(PromiseBase* i);
+  // queue `i` to be updated, once.
+  virtual void schedule(PromiseBase* i);
+  virtual void settled(PromiseBase*) { inprogress--; }
 
  private:
-  list<PromiseBase*> pool;
+  void unlink(PromiseBase* i);
+
+  PromiseBase* head = nullptr;
+  PromiseBase* tail = nullptr;
+  size_t inprogress = 0;
+};
+
+// Link from a promise to one it waits for. Waiters are kept in an intrusive
+// list on the awaited promise, so watching and unwatching are O(1).
+class Waiter {
+ public:
+  Waiter() = default;
+  Waiter(const Waiter&) = delete;
+  virtual ~Waiter() { unwatch(); }
+
+  void watch(PromiseBase* p);
+  void unwatch();
+
+ protected:
+  // `target` resolved or rejected, the waiter is already unwatched.
+  virtual void settled() = 0;
+
+ private:
+  friend class PromiseBase;
+  PromiseBase* target = nullptr;
+  Waiter* prev = nullptr;
+  Waiter* next = nullptr;
 };
 
 class PromiseBase {
@@ -126,23 +159,81 @@ class PromiseBase {
   PromiseBase(const PromiseBase& r) = delete;
   PromiseBase(PromiseBase&& r) = delete;
   virtual ~PromiseBase() {
+    awaiting.unwatch();
+    while (waiters)
+      waiters->unwatch();
     auto s = Executor::instance();
     if (s)
       s->remove(this);
   }
+  // a promise settles once, later calls are ignored.
   void rejected(exception_ptr e) {
+    if (state != State::Inprogress)
+      return;
     state = State::Failed;
     excep = e;
+    settle();
     if (errorCb)
       onError(errorCb);
   }
+  void settle() {
+    if (auto s = Executor::instance())
+      s->settled(this);
+    while (auto w = waiters) {
+      w->unwatch();
+      w->settled();
+    }
+  }
+
+  // wakes this promise when subFsm settles.
+  struct SubWaiter : Waiter {
+    PromiseBase* owner;
+    SubWaiter(PromiseBase* o) : owner(o) {}
+    void settled() override {
+      if (auto s = Executor::instance())
+        s->schedule(owner);
+    }
+  };
 
  protected:
   Ptr<PromiseBase> subFsm;
   exception_ptr excep;
   Action<exception&> errorCb;
+  SubWaiter awaiting{this};
+
+ private:
+  friend class Executor;
+  friend class Waiter;
+  Waiter* waiters = nullptr;
+  // ready queue links.
+  PromiseBase* prevReady = nullptr;
+  PromiseBase* nextReady = nullptr;
+  bool ready = false;
 };
 
+inline void Waiter::watch(PromiseBase* p) {
+  unwatch();
+  target = p;
+  prev = nullptr;
+  next = p->waiters;
+  if (next)
+    next->prev = this;
+  p->waiters = this;
+}
+
+inline void Waiter::unwatch() {
+  if (!target)
+    return;
+  if (prev)
+    prev->next = next;
+  else
+    target->waiters = next;
+  if (next)
+    next->prev = prev;
+  target = nullptr;
+  prev = next = nullptr;
+}
+
 template <typename T>
 class Promise : public PromiseBase {
  public:
@@ -167,15 +258,25 @@ class Promise : public PromiseBase {
   }
 
  protected:
+  // resume until the body awaits a promise in progress, or returns. A body
+  // returning nothing is left to be settled from outside.
   void update() override {
-    if (subFsm && subFsm->state == State::Inprogress) {
-      return;
+    while (state == State::Inprogress) {
+      if (subFsm && subFsm->state == State::Inprogress) {
+        awaiting.watch(subFsm.get());
+        return;
+      }
+      subFsm = fsm(callResolved, callError);
+      if (!subFsm)
+        return;
     }
-    subFsm = fsm(callResolved, callError);
   }
   void resolved(T v) {
+    if (state != State::Inprogress)
+      return;
     value = v;
     state = State::Completed;
+    settle();
     if (okCb)
       okCb(value);
   }
@@ -193,29 +294,86 @@ class Promise : public PromiseBase {
 template <typename T>
 using PromisePtr = Ptr<Promise<T>>;
 
-bool Executor::updateAll() {
-  auto inprogress = false;
-  for (auto i : instance()->pool) {
-    if (i->state == PromiseBase::State::Inprogress) {
-      inprogress = true;
+inline bool Executor::updateAll() {
+  while (auto i = head) {
+    unlink(i);
+    if (i->state == PromiseBase::State::Inprogress)
       i->update();
-    }
   }
-  return inprogress;
+  return inprogress > 0;
 }
 
-inline static PromisePtr<bool> all(const list<Ptr<PromiseBase>>& l) {
-  CoBegin(bool) {
-    auto allDone = true;
-    for (auto& i : l) {
-      if (i->state == PromiseBase::State::Inprogress) {
-        allDone = false;
-        break;
-      }
+inline void Executor::remove(PromiseBase* i) {
+  if (i->state == PromiseBase::State::Inprogress)
+    inprogress--;
+  unlink(i);
+}
+
+inline void Executor::schedule(PromiseBase* i) {
+  if (i->ready)
+    return;
+  i->ready = true;
+  i->prevReady = tail;
+  i->nextReady = nullptr;
+  if (tail)
+    tail->nextReady = i;
+  else
+    head = i;
+  tail = i;
+}
+
+inline void Executor::unlink(PromiseBase* i) {
+  if (!i->ready)
+    return;
+  if (i->prevReady)
+    i->prevReady->nextReady = i->nextReady;
+  else
+    head = i->nextReady;
+  if (i->nextReady)
+    i->nextReady->prevReady = i->prevReady;
+  else
+    tail = i->prevReady;
+  i->prevReady = i->nextReady = nullptr;
+  i->ready = false;
+}
+
+// Resolves once every promise of the list has resolved or rejected. Each
+// settling promise bumps a count, the list is never scanned again.
+class AllPromise : public Promise<bool> {
+ public:
+  AllPromise(const list<Ptr<PromiseBase>>& l)
+      : Promise(nullptr),
+        promises(l),
+        counters(new Counter[l.size()]),
+        remaining(l.size()) {
+    auto c = counters.get();
+    for (auto& i : promises) {
+      c->owner = this;
+      if (i->state == State::Inprogress)
+        c->watch(i.get());
+      else
+        remaining--;
+      c++;
     }
-    if (allDone)
-      CoReturn(true);
+    if (!remaining)
+      resolved(true);
   }
-  CoEnd()
+
+ private:
+  struct Counter : Waiter {
+    AllPromise* owner = nullptr;
+    void settled() override {
+      if (!--owner->remaining)
+        owner->resolved(true);
+    }
+  };
+
+  list<Ptr<PromiseBase>> promises;
+  unique_ptr<Counter[]> counters;
+  size_t remaining;
+};
+
+inline static PromisePtr<bool> all(const list<Ptr<PromiseBase>>& l) {
+  return make_shared<AllPromise>(l);
 }
 }  // namespace co
@@ -2,13 +2,25 @@
 
 #include <assert.h>
 #include <iostream>
+#include <mutex>
 #include <sstream>
+#include <thread>
 
 #define TPRC_DELIMITER(n) n << ' '
-#include "trpc.h"
+#include "asioTRpc.h"
+#include "coroutine.h"
 
 using namespace trpc;
 int pass = 0;
+auto mainThread = std::this_thread::get_id();
+
+// written field by field without operators of its own.
+struct Quote {
+  int64_t time;
+  int id;
+  float bid, ask;
+  uint32_t size;
+};
 
 class MyRpc : public RpcHandler<MyRpc, std::iostream> {
  public:
@@ -27,6 +39,31 @@ class MyRpc : public RpcHandler<MyRpc, std::iostream> {
     cb("OK", a - b);
   }
 
+  // replies only once told to.
+  TRPC(hold)
+  void hold(SessionID sid, RespCb<int> cb) { held = cb; }
+  RespCb<int> held;
+
+  // inline until the server has a worker pool.
+  TRPC_POOLED(offThread)
+  void offThread(SessionID sid, RespCb<bool> cb) {
+    cb(std::this_thread::get_id() != mainThread);
+  }
+
+  // streams the squares below n, as fast as the client takes them.
+  TRPC(squares)
+  void squares(SessionID sid, int n, Writer<int> w) {
+    auto i = std::make_shared<int>(0);
+    w.onReady([=]() mutable {
+      while (w.ready() && *i < n) {
+        w.write(*i * *i);
+        ++*i;
+      }
+      if (*i == n)
+        w.end();
+    });
+  }
+
   void callClient(SessionID sid) {
     server->call(sid, "clientFunc", 11, 2, [](string msg, int r) {
       assert(msg == "fromClient");
@@ -36,11 +73,42 @@ class MyRpc : public RpcHandler<MyRpc, std::iostream> {
   }
 };
 
+#ifdef TRPC_COROUTINES
+// a failed call throws RpcError from co_await.
+Task<> awaitHold(RpcClient<std::iostream>& client, Status& st) {
+  try {
+    co_await client.call<int>("MyRpc.hold");
+    st = Status::Ok;
+  } catch (RpcError& e) {
+    st = e.status;
+  }
+}
+#endif
+
+// settles when `resolve` is called from outside.
+co::PromisePtr<int> later(co::Action<int>* resolve) {
+  CoBegin(int) {
+    __state++;
+    *resolve = __onOk;
+  }
+  CoEnd()
+}
+
+co::PromisePtr<int> plusOne(co::Action<int>* resolve) {
+  int v = 0;
+  CoBegin(int) {
+    CoAwaitData(v, later(resolve));
+    CoReturn(v + 1);
+  }
+  CoEnd()
+}
+
 int main() {
   std::stringstream serverStream, clientStream;
 
   RpcServer<std::iostream> server;
-  server.addHandlers({new MyRpc});
+  auto myRpc = new MyRpc;
+  server.addHandlers({myRpc});
 
   int sessionID = 1;
   server.addSession(sessionID, serverStream);
@@ -62,6 +130,8 @@ int main() {
     cb("fromClient", a * b);
   });
 
+  client.resolve("MyRpc.add", [](bool ok) { assert(ok); });
+
   {
     int data_a = 11, data_b = 22;
     client.onNotify("onAdd", [=](string msg, int a, int b) {
@@ -93,5 +163,424 @@ int main() {
                 });
   }
 
+  // topics, with a second session subscribing conflated.
+  {
+    std::stringstream serverStream2, clientStream2;
+    int sessionID2 = 2;
+    server.addSession(sessionID2, serverStream2);
+    RpcClient<std::iostream> client2(clientStream2);
+    client2.flush = [&] {
+      server.onReceive(sessionID2, clientStream2);
+      clientStream2.clear();
+    };
+    server.flush = [&](SessionID sid) {
+      auto& out = sid == sessionID ? serverStream : serverStream2;
+      (sid == sessionID ? client : client2).onReceive(out);
+      out.clear();
+    };
+
+    // no session is ever slow without `writable`, conflating is refused.
+    client2.subscribe("price", [](string, int) {}, true,
+                      [](bool ok) { assert(!ok); });
+    bool slow = false;
+    server.writable = [&](SessionID sid) {
+      return sid != sessionID2 || !slow;
+    };
+
+    std::map<string, int> got;
+    int n1 = 0, n2 = 0;
+    client.subscribe("price", [&](string, int) { n1++; });
+    client2.subscribe(
+        "price",
+        [&](string key, int v) {
+          got[key] = v;
+          n2++;
+        },
+        true, [](bool ok) { assert(ok); });
+
+    slow = true;
+    for (int v = 1; v <= 3; v++) {
+      server.publishKey("price", "a", v);
+      server.publishKey("price", "b", v * 10);
+    }
+    assert(n1 == 6 && n2 == 0);
+    slow = false;
+    server.sessionWritable(sessionID2, true);
+    // only the latest value of each key.
+    assert(n2 == 2 && got["a"] == 3 && got["b"] == 30);
+    pass++;
+
+    client.unsubscribe("price");
+    server.publishKey("price", "a", 4);
+    assert(n1 == 6 && n2 == 3 && got["a"] == 4);
+    pass++;
+
+    // leaving drops the subscription.
+    server.removeSession(sessionID2);
+    server.addSession(sessionID2, serverStream2);
+    server.publishKey("price", "a", 5);
+    assert(n2 == 3);
+    pass++;
+  }
+
+  // losing the connection cancels the calls still pending.
+  {
+    Status st = Status::Ok;
+    client.call("MyRpc.hold", [&](Status s, int) { st = s; });
+    assert(st == Status::Ok);
+    client.connectionLost();
+    assert(st == Status::Cancelled);
+    pass++;
+  }
+
+  // pooled functions run on a worker, their replies go out from post().
+  {
+    std::mutex lock;
+    vector<Action<>> posted;
+    server.post = [&](SessionID, Action<> f) {
+      std::lock_guard<std::mutex> l(lock);
+      posted.push_back(f);
+    };
+    int offThread = -1;
+    client.call("MyRpc.offThread", [&](bool b) { offThread = b; });
+    assert(offThread == 0);
+    server.setWorkerPool(1);
+    offThread = -1;
+    client.call("MyRpc.offThread", [&](bool b) { offThread = b; });
+    while (offThread < 0) {
+      vector<Action<>> run;
+      {
+        std::lock_guard<std::mutex> l(lock);
+        run.swap(posted);
+      }
+      for (auto& f : run)
+        f();
+    }
+    assert(offThread == 1);
+    server.setWorkerPool(0);
+    server.post = nullptr;
+    pass++;
+  }
+
+  // several messages in one frame are all dispatched.
+  {
+    auto flush = client.flush;
+    client.flush = [] {};
+    int replies = 0;
+    for (int i = 0; i < 3; i++)
+      client.call("MyRpc.offThread", [&](bool) { replies++; });
+    assert(replies == 0);
+    flush();
+    client.flush = flush;
+    assert(replies == 3);
+    pass++;
+  }
+
+  // the compact codec round-trips, small values in fewer bytes.
+  {
+    MemOStream raw, compact;
+    compact.setCodec(Codec::Compact);
+    for (auto o : {&raw, &compact}) {
+      *o << -1;
+      *o << 300;
+      *o << INT_MIN;
+      *o << UINT64_MAX;
+      *o << string("hi");
+      *o << 1.5;
+    }
+    assert(compact.getSize() < raw.getSize());
+    MemIStream i(compact.data(), compact.getSize(), Codec::Compact);
+    int a, b, c;
+    uint64_t d;
+    string e;
+    double f;
+    i >> a;
+    i >> b;
+    i >> c;
+    i >> d;
+    i >> e;
+    i >> f;
+    assert(a == -1 && b == 300 && c == INT_MIN && d == UINT64_MAX);
+    assert(e == "hi" && f == 1.5 && !hasMore(i));
+    pass++;
+  }
+
+  // containers of numbers, copied as a block where the codec allows.
+  {
+    vector<double> v{1.5, -2.25, 1e300};
+    vector<int> w{0, -7, 1 << 30};
+    std::array<short, 3> x{1, -2, 3};
+    for (auto codec : {Codec::Raw, Codec::Compact}) {
+      MemOStream o;
+      o.setCodec(codec);
+      o << v;
+      o << w;
+      o << x;
+      MemIStream i(o.data(), o.getSize(), codec);
+      vector<double> v2;
+      vector<int> w2;
+      std::array<short, 3> x2;
+      i >> v2;
+      i >> w2;
+      i >> x2;
+      assert(v2 == v && w2 == w && x2 == x);
+    }
+    pass++;
+  }
+
+  // aggregates, alone and in containers.
+  {
+    vector<Quote> qs{{42, 1, 1.5f, 2.5f, 100}, {-1, 2, 0, 1e9f, 0}};
+    for (auto codec : {Codec::Raw, Codec::Compact}) {
+      MemOStream o;
+      o.setCodec(codec);
+      o << qs[0];
+      o << qs;
+      MemIStream i(o.data(), o.getSize(), codec);
+      Quote q;
+      vector<Quote> qs2;
+      i >> q;
+      i >> qs2;
+      assert(q.time == 42 && q.ask == 2.5f && q.size == 100);
+      assert(qs2.size() == 2 && qs2[1].time == -1 && qs2[1].ask == 1e9f);
+    }
+    pass++;
+  }
+
+  // views point into the frame, Bytes keep it alive.
+  {
+    MemOStream o;
+    o << string_view("hello");
+    o << string("world");
+    auto frame = std::make_shared<string>(o.data(), o.getSize());
+    std::weak_ptr<string> alive = frame;
+    Bytes b;
+    {
+      MemIStream i(frame->data(), frame->size(), Codec::Raw, frame);
+      string_view v;
+      i >> v;
+      i >> b;
+      assert(v == "hello" && v.data() > frame->data());
+      assert(v.data() + v.size() <= frame->data() + frame->size());
+    }
+    frame.reset();
+    assert(!alive.expired() && b.view() == "world");
+    b = Bytes();
+    assert(alive.expired());
+    pass++;
+  }
+
+  // a reused request slot gets a new id, the old one matches nothing.
+  {
+    RequestTable<SmallFunction<void(int)>> table(10);
+    int got = 0;
+    auto a = table.add([&](int v) { got = v; });
+    assert(a >= 10 && table.size() == 1);
+    table.take(a)(1);
+    auto b = table.add([&](int v) { got = v; });
+    assert(b != a && !table.take(a));
+    table.take(b)(2);
+    assert(got == 2 && table.size() == 0);
+    pass++;
+  }
+
+  // a call past its deadline fails with Status::Timeout, a late reply
+  // is dropped.
+  {
+    int calls = 0;
+    Status st = Status::Ok;
+    client.call(std::chrono::milliseconds(50), "MyRpc.hold",
+                [&](Status s, int) {
+                  st = s;
+                  calls++;
+                });
+    assert(client.hasDeadlines());
+    client.expire(std::chrono::steady_clock::now() +
+                  std::chrono::milliseconds(10));
+    assert(calls == 0);
+    client.expire(std::chrono::steady_clock::now() + std::chrono::seconds(1));
+    assert(calls == 1 && st == Status::Timeout && !client.hasDeadlines());
+    myRpc->held(7);
+    assert(calls == 1);
+    // unlike a frame, the stream keeps what the client didn't take.
+    serverStream.str("");
+    serverStream.clear();
+    pass++;
+  }
+
+  // under DropNotifies a session past its high watermark misses notifies.
+  {
+    int n = 0;
+    client.onNotify("tick", [&](int) { n++; });
+    bool slow = true;
+    server.writable = [&](SessionID) { return !slow; };
+    server.overflow = Overflow::DropNotifies;
+    server.notify(sessionID, "tick", 1);
+    slow = false;
+    server.notify(sessionID, "tick", 2);
+    assert(n == 1);
+    server.overflow = Overflow::Block;
+    server.writable = nullptr;
+    pass++;
+  }
+
+#ifdef TRPC_COROUTINES
+  // an awaited call resumes its coroutine from onReceive.
+  {
+    Status st = Status::Timeout;
+    auto t = awaitHold(client, st);
+    assert(!t.done());
+    myRpc->held(5);
+    assert(t.done() && st == Status::Ok);
+    auto t2 = awaitHold(client, st);
+    client.connectionLost();
+    assert(t2.done() && st == Status::Cancelled);
+    pass++;
+  }
+#endif
+
+  // a promise resumes once what it awaits settles, nothing is polled.
+  {
+    co::Executor executor;
+    co::Action<int> resolve;
+    int got = 0;
+    auto p = plusOne(&resolve);
+    p->onDone([&](int v) { got = v; });
+    assert(executor.updateAll() && got == 0);
+    resolve(41);
+    assert(!executor.updateAll() && got == 42);
+    pass++;
+  }
+
+  // a large repetitive frame goes out compressed and comes back the same.
+  {
+    string text;
+    while (text.size() < 1000)
+      text += "quote ";
+    MemOStream body;
+    body.write(text.data(), text.size());
+    AsioPeer::Compression compression;
+    compression.threshold = 64;
+    auto frame = AsioPeer::shareFrame(body, compression);
+    assert(frame->size() < text.size());
+    FrameReader frames;
+    memcpy(frames.input.writePtr(), frame->data(), frame->size());
+    frames.input.commit(frame->size());
+    string got;
+    assert(frames.parse([&](MemIStream& f) {
+      while (hasMore(f)) {
+        char x;
+        f >> x;
+        got += x;
+      }
+    }));
+    assert(got == text);
+    pass++;
+  }
+
+  // a stream writes no further ahead than the credit the reader granted.
+  {
+    auto clientFlush = client.flush;
+    auto serverFlush = server.flush;
+    client.flush = [] {};
+    server.flush = [](SessionID) {};
+    client.streamWindow = 2;
+    vector<int> got;
+    Status end = Status::Failed;
+    client.stream("MyRpc.squares", 5, [&](int sq) { got.push_back(sq); },
+                  [&](Status st, const string&) { end = st; });
+    // each round trip carries the credit for two more chunks.
+    for (size_t before = 0; end != Status::Ok; before = got.size()) {
+      server.onReceive(sessionID, clientStream);
+      clientStream.clear();
+      client.onReceive(serverStream);
+      serverStream.clear();
+      assert(got.size() > before && got.size() <= before + 2);
+    }
+    assert((got == vector<int>{0, 1, 4, 9, 16}));
+    client.flush = clientFlush;
+    server.flush = serverFlush;
+    client.streamWindow = 16;
+    pass++;
+  }
+
+  // a multicast reaches the sessions listed, encoded once when the
+  // transport shares frames.
+  {
+    int ticks = 0;
+    client.onNotify("tick", [&](int v) {
+      assert(v == 3);
+      ticks++;
+    });
+    server.multicast({sessionID, 99}, "tick", 3);
+    assert(ticks == 1);
+    int encoded = 0;
+    server.encodeFrame = [&](const std::function<void(std::iostream&)>& w) {
+      std::stringstream o;
+      w(o);
+      encoded++;
+      return std::make_shared<string>(o.str());
+    };
+    server.sendFrame = [&](SessionID sid, const SharedFrame& f) {
+      serverStream << *f;
+      server.flush(sid);
+    };
+    server.multicast({sessionID, sessionID}, "tick", 3);
+    assert(ticks == 3 && encoded == 1);
+    server.encodeFrame = nullptr;
+    server.sendFrame = nullptr;
+    pass++;
+  }
+
+  // a method's calls are counted in flight until their reply goes out.
+  {
+    auto stats = [&] {
+      for (auto& m : server.metrics.snapshot())
+        if (m.name == "MyRpc.hold")
+          return m;
+      return MethodStats();
+    };
+    auto before = stats();
+    client.call("MyRpc.hold", [](int) {});
+    assert(stats().inFlight == before.inFlight + 1);
+    myRpc->held(1);
+    auto after = stats();
+    assert(after.calls == before.calls + 1);
+    assert(after.inFlight == before.inFlight);
+    assert(after.latency.count() == before.latency.count() + 1);
+    Histogram h;
+    for (uint64_t v = 1; v <= 100; v++)
+      h.record(v);
+    assert(h.percentile(50) == 50 && h.max() == 100);
+    pass++;
+  }
+
+  // frames split anywhere, an empty one included, come out whole.
+  {
+    string wire;
+    for (string body : {"abc", "", "de"}) {
+      auto head = imp::littleEndian((uint64_t)body.size());
+      wire.append((const char*)&head, sizeof(head));
+      wire += body;
+    }
+    FrameReader frames;
+    vector<string> got;
+    for (char c : wire) {
+      *frames.input.writePtr() = c;
+      frames.input.commit(1);
+      assert(frames.parse([&](MemIStream& f) {
+        string s;
+        while (hasMore(f)) {
+          char x;
+          f >> x;
+          s += x;
+        }
+        got.push_back(s);
+      }));
+    }
+    assert((got == vector<string>{"abc", "", "de"}));
+    pass++;
+  }
+
   std::cout << "PASS:" << pass << std::endl;
 }
@@ -0,0 +1,120 @@
+//////////////////////////////////////////////////////////////////////////
+// Log-linear latency histogram
+//
+// by soniced@sina.com.
+// All rights reserved.
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+namespace trpc {
+
+// HDR-style histogram of non-negative integer values, typically nanoseconds.
+// Values below 2^SubBits are counted exactly, bigger ones in buckets of
+// 2^(SubBits-1) linear steps per power of two, so any value is known within
+// 1/64 of itself. Recording is a bit scan, a shift and an increment.
+class Histogram {
+ public:
+  static constexpr int SubBits = 7;
+  // values above are counted as MaxValue, ~18 minutes in nanoseconds.
+  static constexpr uint64_t MaxValue = (1ull << 40) - 1;
+
+  Histogram() : counts(indexOf(MaxValue) + 1) {}
+
+  void record(uint64_t v, uint64_t n = 1) {
+    v = std::min(v, MaxValue);
+    counts[indexOf(v)] += n;
+    total += n;
+    sum += v * n;
+    lo = std::min(lo, v);
+    hi = std::max(hi, v);
+  }
+
+  void merge(const Histogram& o) {
+    for (size_t i = 0; i < counts.size(); i++)
+      counts[i] += o.counts[i];
+    total += o.total;
+    sum += o.sum;
+    lo = std::min(lo, o.lo);
+    hi = std::max(hi, o.hi);
+  }
+
+  void reset() {
+    std::fill(counts.begin(), counts.end(), 0);
+    total = sum = hi = 0;
+    lo = UINT64_MAX;
+  }
+
+  uint64_t count() const { return total; }
+  uint64_t min() const { return total ? lo : 0; }
+  uint64_t max() const { return hi; }
+  double mean() const { return total ? (double)sum / total : 0; }
+
+  // smallest value v such that `p` percent of the values are <= v, as the
+  // upper end of its bucket.
+  uint64_t percentile(double p) const {
+    if (!total)
+      return 0;
+    auto rank = (uint64_t)(p / 100 * total + 0.5);
+    rank = std::max<uint64_t>(1, std::min(rank, total));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+      seen += counts[i];
+      if (seen >= rank)
+        return std::min(upperOf(i), hi);
+    }
+    return hi;
+  }
+
+  // number of values <= v, to bucket precision: the bucket holding v only
+  // counts if it ends at v, so nothing larger is ever counted.
+  uint64_t countUpTo(uint64_t v) const {
+    auto last = indexOf(std::min(v, MaxValue));
+    auto end = upperOf(last) <= v ? last + 1 : last;
+    uint64_t n = 0;
+    for (size_t i = 0; i < end; i++)
+      n += counts[i];
+    return n;
+  }
+
+ private:
+  static constexpr uint64_t Half = 1ull << (SubBits - 1);
+
+  static size_t indexOf(uint64_t v) {
+    if (v < 2 * Half)
+      return (size_t)v;
+#if defined(__GNUC__)
+    int msb = 63 - __builtin_clzll(v);
+#else
+    int msb = 0;
+    for (auto x = v, step = (uint64_t)32; step; step /= 2) {
+      if (x >> step) {
+        x >>= step;
+        msb += (int)step;
+      }
+    }
+#endif
+    auto shift = msb - (SubBits - 1);
+    return (size_t)(shift * Half + (v >> shift));
+  }
+
+  // largest value counted in bucket i.
+  static uint64_t upperOf(size_t i) {
+    if (i < 2 * Half)
+      return i;
+    auto shift = i / Half - 1;
+    auto mantissa = i - shift * Half;
+    return ((mantissa + 1) << shift) - 1;
+  }
+
+  std::vector<uint64_t> counts;
+  uint64_t total = 0;
+  uint64_t sum = 0;
+  uint64_t lo = UINT64_MAX;
+  uint64_t hi = 0;
+};
+
+}  // namespace trpc
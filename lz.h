@@ -0,0 +1,191 @@
+//////////////////////////////////////////////////////////////////////////
+// Small LZ77 block codec for frame compression
+//
+// by soniced@sina.com.
+// All rights reserved.
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace trpc {
+
+// Block format, a sequence of:
+//   token: literal count in the high nibble, match length - MinMatch in the
+//          low one, 15 meaning more length bytes follow (each adding up to
+//          255, the last one below 255)
+//   literal bytes
+//   16-bit little-endian offset of the match, then its extra length bytes
+// The last sequence has literals only. Matches are found through a hash
+// table of 4-byte prefixes that is kept across blocks: stale entries are
+// checked against the bytes before use, so it never needs clearing.
+class LzCodec {
+ public:
+  static constexpr size_t MinMatch = 4;
+  static constexpr size_t MaxOffset = 65535;
+
+  // worst case size of compressing `n` bytes.
+  static size_t bound(size_t n) { return n + n / 255 + 16; }
+
+  // compress `n` bytes at `src` to the end of `dst`, returns the size
+  // written.
+  size_t compress(const char* src, size_t n, std::string& dst) {
+    if (table.empty())
+      table.assign(TableSize, 0);
+    auto start = dst.size();
+    dst.resize(start + bound(n));
+    auto out = (uint8_t*)&dst[start];
+    auto op = out;
+    auto ip = (const uint8_t*)src;
+    auto base = ip, end = ip + n, anchor = ip;
+    // the last bytes are always literals, so reading 4 bytes never overruns.
+    auto matchLimit = n > LastLiterals ? end - LastLiterals : base;
+
+    while (ip < matchLimit) {
+      auto seq = read32(ip);
+      auto& slot = table[hash(seq)];
+      auto cand = base + slot;
+      slot = (uint32_t)(ip - base);
+      if (cand >= ip || ip - cand > (std::ptrdiff_t)MaxOffset ||
+          read32(cand) != seq) {
+        // step further the longer nothing matched, incompressible data
+        // goes by quickly.
+        ip += 1 + ((ip - anchor) >> SkipShift);
+        continue;
+      }
+      auto len = MinMatch;
+      while (end - ip >= (std::ptrdiff_t)(len + 8) &&
+             read64(ip + len) == read64(cand + len))
+        len += 8;
+      while (ip + len < end && ip[len] == cand[len])
+        len++;
+
+      op = putSequence(op, anchor, ip - anchor, ip - cand, len);
+      ip += len;
+      anchor = ip;
+    }
+    op = putSequence(op, anchor, end - anchor, 0, 0);
+    auto written = (size_t)(op - out);
+    dst.resize(start + written);
+    return written;
+  }
+
+  // decompress `n` bytes at `src` into `dst`, which must end up exactly
+  // `size` bytes long. False on malformed input.
+  static bool decompress(const char* src,
+                         size_t n,
+                         std::string& dst,
+                         size_t size) {
+    dst.resize(size);
+    auto ip = (const uint8_t*)src, end = ip + n;
+    auto op = (uint8_t*)&dst[0];
+    auto out = op, outEnd = op + size;
+
+    while (ip < end) {
+      auto token = *ip++;
+      size_t lit = token >> 4;
+      if (lit == 15 && !readLength(ip, end, lit))
+        return false;
+      if ((size_t)(end - ip) < lit || (size_t)(outEnd - op) < lit)
+        return false;
+      memcpy(op, ip, lit);
+      ip += lit;
+      op += lit;
+      if (ip == end)
+        break;
+
+      if (end - ip < 2)
+        return false;
+      size_t offset = ip[0] | (ip[1] << 8);
+      ip += 2;
+      size_t len = token & 15;
+      if (len == 15 && !readLength(ip, end, len))
+        return false;
+      len += MinMatch;
+      if (!offset || offset > (size_t)(op - out) ||
+          (size_t)(outEnd - op) < len)
+        return false;
+      // the match may overlap the bytes it produces, copy at most `offset`
+      // bytes at a time.
+      while (len) {
+        auto chunk = len < offset ? len : offset;
+        memcpy(op, op - offset, chunk);
+        op += chunk;
+        len -= chunk;
+      }
+    }
+    return op == outEnd;
+  }
+
+ private:
+  static constexpr int TableBits = 14;
+  static constexpr size_t TableSize = 1 << TableBits;
+  static constexpr size_t LastLiterals = 8;
+  static constexpr int SkipShift = 6;
+
+  static uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  static uint64_t read64(const uint8_t* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  static uint32_t hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - TableBits);
+  }
+
+  static uint8_t* putLength(uint8_t* op, size_t len) {
+    for (; len >= 255; len -= 255)
+      *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+  }
+
+  static bool readLength(const uint8_t*& ip, const uint8_t* end, size_t& len) {
+    uint8_t b;
+    do {
+      if (ip == end)
+        return false;
+      b = *ip++;
+      len += b;
+    } while (b == 255);
+    return true;
+  }
+
+  // literals then, unless `len` is 0, a match.
+  static uint8_t* putSequence(uint8_t* op,
+                              const uint8_t* lit,
+                              size_t litLen,
+                              size_t offset,
+                              size_t len) {
+    auto token = op++;
+    *token = (uint8_t)((litLen < 15 ? litLen : 15) << 4);
+    if (litLen >= 15)
+      op = putLength(op, litLen - 15);
+    memcpy(op, lit, litLen);
+    op += litLen;
+    if (!len)
+      return op;
+
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    len -= MinMatch;
+    *token |= (uint8_t)(len < 15 ? len : 15);
+    if (len >= 15)
+      op = putLength(op, len - 15);
+    return op;
+  }
+
+  std::vector<uint32_t> table;
+};
+
+}  // namespace trpc
@@ -51,6 +51,14 @@ void QtRpcClient::connectServer(QString ip, int port, SocketCb cb) {
     }
   });
 
+  // ticks the timing wheel only while calls with a deadline are pending.
+  expiryTimer = new QTimer(socket);
+  expiryTimer->connect(expiryTimer, &QTimer::timeout, [this] {
+    expire();
+    if (!hasDeadlines())
+      expiryTimer->stop();
+  });
+
   flush = [this]() {
     int sz = block.size();
     QByteArray b;
@@ -64,6 +72,8 @@ void QtRpcClient::connectServer(QString ip, int port, SocketCb cb) {
     if (mIsConnected) {
       output.device()->reset();
     }
+    if (hasDeadlines() && !expiryTimer->isActive())
+      expiryTimer->start(TimerTick.count());
   };
 
   socket->connectToHost(ip, port);
@@ -74,6 +84,7 @@ void QtRpcClient::close() {
     socket->close();
     delete socket;
     socket = nullptr;
+    expiryTimer = nullptr;
   }
   mIsConnected = false;
 }
@@ -31,6 +31,7 @@ class QtRpcClient : public RpcClient<QDataStream> {
   QAbstractSocket::SocketError socketError;
   int packageSize = 0;
   QTcpSocket* socket = nullptr;
+  QTimer* expiryTimer = nullptr;
   QByteArray block;
   QDataStream output{&block, QIODevice::WriteOnly};
 };
@@ -13,4 +13,18 @@ inline QDataStream& operator>>(QDataStream& s, std::string& v) {
 inline QDataStream& operator<<(QDataStream& s, std::string& v) {
   return s << v.c_str();
 }
+
+inline bool hasMore(QDataStream& s) {
+  return !s.atEnd();
+}
+
+inline size_t readOffset(QDataStream& s) {
+  return s.device() ? (size_t)s.device()->pos() : 0;
+}
+
+inline size_t writeOffset(QDataStream& s) {
+  return s.device() ? (size_t)s.device()->pos() : 0;
+}
+
+inline void markCompressible(QDataStream& s) {}
 }  // namespace trpc
\ No newline at end of file
@@ -0,0 +1,332 @@
+//////////////////////////////////////////////////////////////////////////
+// Pending request table
+//
+// by soniced@sina.com.
+// All rights reserved.
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace trpc {
+
+// resolution of request deadlines.
+constexpr std::chrono::milliseconds TimerTick{10};
+
+template <typename Sig, size_t Size = 128>
+class SmallFunction;
+
+// Move-only std::function keeping callables of up to `Size` bytes inline.
+// Bigger ones are put on the heap.
+template <typename R, typename... A, size_t Size>
+class SmallFunction<R(A...), Size> {
+ public:
+  SmallFunction() = default;
+  SmallFunction(std::nullptr_t) {}
+
+  template <typename F,
+            typename = std::enable_if_t<
+                !std::is_same_v<std::decay_t<F>, SmallFunction>>>
+  SmallFunction(F&& f) {
+    using T = std::decay_t<F>;
+    if constexpr (Inline<T>)
+      new (buf) T(std::forward<F>(f));
+    else
+      *(T**)buf = new T(std::forward<F>(f));
+    ops = opsOf<T>();
+  }
+
+  SmallFunction(SmallFunction&& o) noexcept { take(o); }
+  SmallFunction& operator=(SmallFunction&& o) noexcept {
+    if (this != &o) {
+      reset();
+      take(o);
+    }
+    return *this;
+  }
+  ~SmallFunction() { reset(); }
+
+  explicit operator bool() const { return ops != nullptr; }
+
+  R operator()(A... a) { return ops->invoke(buf, std::forward<A>(a)...); }
+
+  void reset() {
+    if (ops)
+      ops->destroy(buf);
+    ops = nullptr;
+  }
+
+ private:
+  struct Ops {
+    R (*invoke)(void*, A&&...);
+    void (*move)(void* from, void* to);
+    void (*destroy)(void*);
+  };
+
+  template <typename T>
+  static constexpr bool Inline = sizeof(T) <= Size &&
+                                 alignof(T) <= alignof(std::max_align_t) &&
+                                 std::is_nothrow_move_constructible_v<T>;
+
+  template <typename T>
+  static const Ops* opsOf() {
+    if constexpr (Inline<T>) {
+      static const Ops ops{
+          [](void* p, A&&... a) -> R {
+            return (*(T*)p)(std::forward<A>(a)...);
+          },
+          [](void* from, void* to) {
+            new (to) T(std::move(*(T*)from));
+            ((T*)from)->~T();
+          },
+          [](void* p) { ((T*)p)->~T(); }};
+      return &ops;
+    } else {
+      static const Ops ops{
+          [](void* p, A&&... a) -> R {
+            return (**(T**)p)(std::forward<A>(a)...);
+          },
+          [](void* from, void* to) { *(T**)to = *(T**)from; },
+          [](void* p) { delete *(T**)p; }};
+      return &ops;
+    }
+  }
+
+  void take(SmallFunction& o) {
+    if (o.ops)
+      o.ops->move(o.buf, buf);
+    ops = o.ops;
+    o.ops = nullptr;
+  }
+
+  alignas(std::max_align_t) char buf[Size];
+  const Ops* ops = nullptr;
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+// Callbacks of requests in flight, by request id. An id encodes the slot
+// holding the callback and the slot's generation, so a late response for a
+// slot that has been reused since is rejected. Freed slots are reused first,
+// the table only allocates when more requests than ever before are in
+// flight.
+//
+// Requests with a deadline are also linked into a two level timing wheel:
+// `WheelSize` buckets TimerTick apart for the current turn, and as many a
+// turn apart for later ones, moved down when their turn starts. Linking,
+// unlinking on response and expiring are all O(1) per request, and a
+// bucket only ever holds requests that are due when it comes up.
+template <typename Func>
+class RequestTable {
+ public:
+  using Clock = std::chrono::steady_clock;
+  static constexpr uint32_t WheelSize = 512;
+
+  // at most 1M requests in flight, ids stay positive ints. The generation
+  // goes in the low bits so ids stay short as varints while few requests
+  // are in flight.
+  static constexpr int GenBits = 10;
+  static constexpr uint32_t GenMask = (1u << GenBits) - 1;
+  static constexpr uint32_t MaxSlots = 1u << (30 - GenBits);
+  // returned by add() when full().
+  static constexpr int Invalid = -1;
+
+  // ids below `base` are reserved.
+  RequestTable(int base) : base(base) {}
+
+  // `deadline` left at its default means the request never expires.
+  int add(Func f, Clock::time_point deadline = {}) {
+    if (full())
+      return Invalid;
+    uint32_t slot;
+    if (!freeSlots.empty()) {
+      slot = freeSlots.back();
+      freeSlots.pop_back();
+    } else {
+      slot = (uint32_t)slots.size();
+      slots.emplace_back();
+    }
+    auto& s = slots[slot];
+    s.func = std::move(f);
+    s.used = true;
+    if (deadline != Clock::time_point{}) {
+      // an empty wheel isn't expired, catch up on the time it sat idle.
+      if (!timed)
+        current = std::max(current, tickOf(Clock::now(), false));
+      link(slot, tickOf(deadline));
+    }
+    return base + (int)((slot << GenBits) | s.gen);
+  }
+
+  // remove request `id` and return its callback, empty if it isn't pending.
+  Func take(int id) {
+    if (id < base)
+      return nullptr;
+    auto key = (uint32_t)(id - base);
+    auto slot = key >> GenBits;
+    if (slot >= slots.size())
+      return nullptr;
+    auto& s = slots[slot];
+    if (!s.used || s.gen != (key & GenMask))
+      return nullptr;
+    return release(slot);
+  }
+
+  // remove every request, returning their callbacks.
+  std::vector<Func> takeAll() {
+    std::vector<Func> funcs;
+    for (uint32_t i = 0; i < slots.size(); i++)
+      if (slots[i].used)
+        funcs.push_back(release(i));
+    return funcs;
+  }
+
+  // remove every request whose deadline has passed at `now`, handing its
+  // callback to `onExpired`. Callbacks may add new requests.
+  template <typename F>
+  void expire(Clock::time_point now, F&& onExpired) {
+    if (!timed)
+      return;
+    auto target = tickOf(now, false);
+    if (target >= current + WheelSize)
+      skipTo(target);
+    for (; current <= target; current++) {
+      if (current % WheelSize == 0)
+        cascade();
+      auto& head = wheel[current % WheelSize];
+      while (head != Nil) {
+        auto i = head;
+        unlink(i);
+        expired.push_back(i);
+      }
+    }
+
+    auto ready = std::move(expired);
+    expired.clear();
+    for (auto i : ready) {
+      auto f = release(i);
+      onExpired(f);
+    }
+    ready.clear();
+    expired.swap(ready);
+  }
+
+  size_t size() const { return slots.size() - freeSlots.size(); }
+  // no id is left for another request.
+  bool full() const { return freeSlots.empty() && slots.size() >= MaxSlots; }
+  // requests with a deadline.
+  size_t timedSize() const { return timed; }
+
+ private:
+  static constexpr uint32_t Nil = ~0u;
+
+  struct Slot {
+    Func func;
+    uint32_t gen = 0;
+    bool used = false;
+    // timing wheel links, tick == 0 if not linked.
+    uint32_t prev = Nil, next = Nil, bucket = 0;
+    uint64_t tick = 0;
+  };
+
+  // Deadlines are rounded up to the next tick and the current time down, so
+  // nothing fires early. Tick 0 is never used.
+  static uint64_t tickOf(Clock::time_point t, bool roundUp = true) {
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  t.time_since_epoch())
+                  .count();
+    if (roundUp)
+      ms += TimerTick.count() - 1;
+    return (uint64_t)(ms / TimerTick.count()) + 1;
+  }
+
+  void link(uint32_t i, uint64_t tick) {
+    if (wheel.empty())
+      wheel.assign(2 * WheelSize, Nil);
+    auto& s = slots[i];
+    s.tick = tick;
+    auto t = std::max(tick, current);
+    if (t < current + WheelSize) {
+      s.bucket = (uint32_t)(t % WheelSize);
+    } else {
+      // the last turn also takes everything further out.
+      auto turn = std::min(t / WheelSize, current / WheelSize + WheelSize - 1);
+      s.bucket = WheelSize + (uint32_t)(turn % WheelSize);
+    }
+    auto& head = wheel[s.bucket];
+    s.prev = Nil;
+    s.next = head;
+    if (head != Nil)
+      slots[head].prev = i;
+    head = i;
+    timed++;
+  }
+
+  void unlink(uint32_t i) {
+    auto& s = slots[i];
+    if (!s.tick)
+      return;
+    if (s.prev != Nil)
+      slots[s.prev].next = s.next;
+    else
+      wheel[s.bucket] = s.next;
+    if (s.next != Nil)
+      slots[s.next].prev = s.prev;
+    s.prev = s.next = Nil;
+    s.tick = 0;
+    timed--;
+  }
+
+  // moves the requests of the turn starting at `current` to its ticks.
+  void cascade() {
+    auto& head = wheel[WheelSize + (current / WheelSize) % WheelSize];
+    while (head != Nil) {
+      auto i = head;
+      auto tick = slots[i].tick;
+      unlink(i);
+      link(i, tick);
+    }
+  }
+
+  // the wheel fell more than a turn behind, relink everything from there.
+  void skipTo(uint64_t target) {
+    std::vector<uint32_t> linked;
+    for (auto head : wheel)
+      for (auto i = head; i != Nil; i = slots[i].next)
+        linked.push_back(i);
+    current = target;
+    for (auto i : linked) {
+      auto tick = slots[i].tick;
+      unlink(i);
+      link(i, tick);
+    }
+  }
+
+  Func release(uint32_t slot) {
+    auto& s = slots[slot];
+    unlink(slot);
+    auto f = std::move(s.func);
+    s.used = false;
+    s.gen = (s.gen + 1) & GenMask;
+    freeSlots.push_back(slot);
+    return f;
+  }
+
+  std::vector<Slot> slots;
+  std::vector<uint32_t> freeSlots;
+  int base;
+
+  std::vector<uint32_t> wheel;
+  std::vector<uint32_t> expired;
+  uint64_t current = 0;
+  size_t timed = 0;
+};
+
+}  // namespace trpc
@@ -0,0 +1,913 @@
+//////////////////////////////////////////////////////////////////////////
+// Shared memory transport for clients and servers on the same host
+//
+// by soniced@sina.com.
+// All rights reserved.
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include "asioTRpc.h"
+
+#if defined(__linux__)
+#define TRPC_SHM 1
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <new>
+
+namespace trpc {
+
+// A server creates one region named like "/myServer" holding `slots`
+// connections. A client claims a free slot and from then on both sides talk
+// through the slot's two single-producer/single-consumer byte rings: frames
+// are written straight into the mapping and read in place, the kernel is
+// only entered to wake a reader that went to sleep.
+//
+// Ring positions count bytes since the slot was opened, the writer owns
+// `head`, the reader `tail`, each on its own cache line. A frame is a 64-bit
+// header, size plus flags, and its bytes padded to 8. Frames never wrap: if
+// one doesn't fit before the end of the ring a wrap marker fills the rest.
+
+namespace imp {
+
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  asm volatile("yield");
+#endif
+}
+
+// process-shared futex on a word of the mapping.
+inline void futexWait(atomic<uint32_t>& word,
+                      uint32_t expected,
+                      std::chrono::nanoseconds timeout) {
+  static_assert(sizeof(word) == sizeof(uint32_t));
+  timespec ts{(time_t)(timeout.count() / 1000000000),
+              (long)(timeout.count() % 1000000000)};
+  syscall(SYS_futex, (uint32_t*)&word, FUTEX_WAIT, expected, &ts, nullptr, 0);
+}
+
+// false only once `pid` is known to be gone, its pid may be reused.
+inline bool processAlive(int32_t pid) {
+  return pid <= 0 || kill(pid, 0) == 0 || errno != ESRCH;
+}
+
+inline void futexWake(atomic<uint32_t>& word) {
+  syscall(SYS_futex, (uint32_t*)&word, FUTEX_WAKE, INT_MAX, nullptr, nullptr,
+          0);
+}
+
+}  // namespace imp
+
+// Where a reader sleeps. Writers only make a syscall when somebody does.
+struct ShmDoorbell {
+  alignas(64) atomic<uint32_t> seq{0};
+  atomic<uint32_t> sleepers{0};
+
+  void ring() {
+    // pairs with the fence in sleep(): either the writer sees the sleeper or
+    // the sleeper sees what was written.
+    atomic_thread_fence(memory_order_seq_cst);
+    if (sleepers.load(memory_order_relaxed)) {
+      seq.fetch_add(1, memory_order_release);
+      imp::futexWake(seq);
+    }
+  }
+
+  template <typename Ready>
+  void sleep(Ready ready, std::chrono::nanoseconds timeout) {
+    auto s = seq.load(memory_order_acquire);
+    sleepers.fetch_add(1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!ready())
+      imp::futexWait(seq, s, timeout);
+    sleepers.fetch_sub(1, memory_order_relaxed);
+  }
+};
+
+namespace imp {
+
+// spin, then sleep on `bell` until `ready()` or `timeout` passed. With
+// `busyPoll` the whole timeout is spent spinning.
+template <typename Ready>
+bool shmWait(ShmDoorbell& bell,
+             std::chrono::nanoseconds spin,
+             bool busyPoll,
+             std::chrono::nanoseconds timeout,
+             Ready ready) {
+  if (ready())
+    return true;
+  auto start = std::chrono::steady_clock::now();
+  auto spinFor = busyPoll ? timeout : std::min(spin, timeout);
+  for (int i = 1;; i++) {
+    if (ready())
+      return true;
+    cpuRelax();
+    // the clock costs more than a poll, look at it now and then.
+    if (i % 64 == 0 && std::chrono::steady_clock::now() - start >= spinFor)
+      break;
+  }
+  auto left = timeout - (std::chrono::steady_clock::now() - start);
+  if (!busyPoll && left.count() > 0)
+    bell.sleep(ready,
+               std::chrono::duration_cast<std::chrono::nanoseconds>(left));
+  return ready();
+}
+
+}  // namespace imp
+
+struct ShmRing {
+  alignas(64) atomic<uint64_t> head{0};
+  alignas(64) atomic<uint64_t> tail{0};
+  // set by a writer that found the ring full, the reader wakes it.
+  atomic<uint32_t> writerBlocked{0};
+};
+
+struct ShmSlot {
+  enum State : uint32_t {
+    Free,
+    // claimed by a client.
+    Open,
+    // the server closed it and waits for the client to let go.
+    Closing,
+    // the client let go, the server frees it.
+    Closed,
+  };
+  alignas(64) atomic<uint32_t> state{Free};
+  // pid of the client holding the slot, 0 until it wrote it.
+  atomic<int32_t> owner{0};
+  ShmDoorbell client;
+  ShmRing toServer, toClient;
+};
+
+struct ShmHeader {
+  static constexpr uint32_t Magic = 0x6d687374;  // "tshm"
+  atomic<uint32_t> magic{0};
+  uint32_t slots = 0;
+  uint64_t ringBytes = 0;
+  atomic<uint32_t> alive{1};
+  // pid of the server, so a region or slot left by a process that died can
+  // be told apart and taken over.
+  int32_t owner = 0;
+  ShmDoorbell server;
+
+  // how often the living check on the other end runs.
+  static constexpr std::chrono::seconds LivenessCheck{1};
+
+  static size_t slotsOffset() { return (sizeof(ShmHeader) + 63) & ~63ull; }
+  static size_t dataOffset(uint32_t slots) {
+    return slotsOffset() + ((slots * sizeof(ShmSlot) + 4095) & ~4095ull);
+  }
+  static size_t totalSize(uint32_t slots, uint64_t ringBytes) {
+    return dataOffset(slots) + slots * 2 * ringBytes;
+  }
+
+  ShmSlot& slot(int i) {
+    return ((ShmSlot*)((char*)this + slotsOffset()))[i];
+  }
+  char* toServer(int i) {
+    return (char*)this + dataOffset(slots) + (2 * i) * ringBytes;
+  }
+  char* toClient(int i) {
+    return (char*)this + dataOffset(slots) + (2 * i + 1) * ringBytes;
+  }
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+// A named POSIX shared memory mapping, unlinked again by its creator.
+class ShmRegion {
+ public:
+  ShmRegion() {}
+  ShmRegion(const ShmRegion&) = delete;
+  ~ShmRegion() { close(); }
+
+  bool create(const string& name, size_t size) {
+    close();
+    auto fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0)
+      return false;
+    owned = name;
+    if (ftruncate(fd, (off_t)size) != 0) {
+      ::close(fd);
+      close();
+      return false;
+    }
+    return map(fd, size);
+  }
+
+  bool open(const string& name) {
+    close();
+    auto fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+      return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(ShmHeader)) {
+      ::close(fd);
+      return false;
+    }
+    return map(fd, (size_t)st.st_size);
+  }
+
+  void close() {
+    if (base)
+      munmap(base, len);
+    base = nullptr;
+    len = 0;
+    if (!owned.empty())
+      shm_unlink(owned.c_str());
+    owned.clear();
+  }
+
+  char* data() const { return base; }
+  size_t size() const { return len; }
+
+ private:
+  bool map(int fd, size_t size) {
+    auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED) {
+      close();
+      return false;
+    }
+    base = (char*)p;
+    len = size;
+    return true;
+  }
+
+  char* base = nullptr;
+  size_t len = 0;
+  string owned;
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+// One end of a slot. Received frames are views into the ring: a frame pinned
+// past its handler, by keeping Bytes or views, holds its ring space and all
+// after it until released, so a handler keeping many should copy instead.
+class ShmPeer {
+ public:
+  // A reader with nothing to do spins for `spin` before sleeping on a futex,
+  // unless there is a single core where spinning only delays the writer.
+  // With `busyPoll` it never sleeps: the lowest latency, for a whole core.
+  struct Waiting {
+    std::chrono::nanoseconds spin{
+        std::thread::hardware_concurrency() > 1 ? 50000 : 0};
+    bool busyPoll = false;
+  };
+  struct Stats {
+    size_t frames = 0;
+    size_t bytes = 0;
+    // frames that found the ring full and waited in the backlog.
+    size_t stalls = 0;
+  };
+  // As for asio peers, on the bytes in the backlog: writable() turns false
+  // above `high` and true again at `low`, past `limit` (8 * high if zero)
+  // onOverLimit() is called. Off while `high` is zero.
+  struct Watermarks {
+    size_t high = 0;
+    size_t low = 0;
+    size_t limit = 0;
+  };
+
+  Waiting waiting;
+  Stats stats;
+  Watermarks watermarks;
+
+  virtual ~ShmPeer() {}
+  virtual void onError(const error_code& err) {
+    printf("error: %s\n", err.message().c_str());
+  }
+  // the backlog crossed a watermark.
+  virtual void onWritable(bool) {}
+  // the backlog grew past the hard limit of `watermarks`.
+  virtual void onOverLimit() {}
+
+  bool writable() const { return isWritable; }
+  size_t backlogBytes() const { return backlogged; }
+
+  // Write the bytes of `body` to the ring as one frame and reset it, false
+  // if it can't go: not attached, or larger than half the ring. When the
+  // ring is full the frame is copied to a backlog that poll() drains.
+  bool send(MemOStream& body) {
+    uint64_t flags = body.getCodec() == Codec::Compact ? FrameCompact : 0;
+    auto n = body.getSize();
+    if (!tx || recordSize(n) > mask / 2 + 1) {
+      body.reset();
+      return false;
+    }
+    if (!backlog.empty() || !put(body.data(), n, flags)) {
+      stats.stalls++;
+      backlog.push_back({flags, string(body.data(), n)});
+      backlogged += n;
+    }
+    body.reset();
+    stats.frames++;
+    stats.bytes += n;
+    remote->ring();
+    updateWritable();
+    return true;
+  }
+
+  void receive(const Action<MemIStream&>& onReceived) { receiver = onReceived; }
+
+  // stop handing frames to the receiver, and start again.
+  void pauseReceive() { paused = true; }
+  void resumeReceive() { paused = false; }
+
+  // hand every frame that arrived to the receiver, returns how many.
+  int poll() {
+    if (!backlog.empty())
+      flushBacklog();
+    if (!pins.empty())
+      releasePins();
+    if (!rx || paused)
+      return 0;
+    int n = 0;
+    auto head = rx->head.load(memory_order_acquire);
+    while (rxPos != head && rx) {
+      auto off = rxPos & mask;
+      uint64_t h;
+      memcpy(&h, rxData + off, sizeof(h));
+      if (h & FrameWrap) {
+        rxPos += mask + 1 - off;
+        continue;
+      }
+      auto size = h & FrameSizeMask;
+      // the writer never puts more than half the ring, nor across its end.
+      if (recordSize(size) > std::min(mask / 2 + 1, mask + 1 - off)) {
+        onError(asio::error::invalid_argument);
+        return n;
+      }
+      auto codec = h & FrameCompact ? Codec::Compact : Codec::Raw;
+      auto begin = rxPos;
+      rxPos += recordSize(size);
+      MemIStream frame(rxData + off + sizeof(h), size, codec, token);
+      receiver(frame);
+      n++;
+      release(begin);
+    }
+    return n;
+  }
+
+  // a frame waits to be read.
+  bool readable() const {
+    return rx && !paused && rxPos != rx->head.load(memory_order_acquire);
+  }
+
+  // a frame waits to be read or the backlog can move on.
+  bool ready() const {
+    return readable() || (!backlog.empty() && tx &&
+                          tx->tail.load(memory_order_relaxed) != txTail);
+  }
+
+  bool attached() const { return tx != nullptr; }
+
+ protected:
+  static constexpr uint64_t FrameCompact = 1ull << 63;
+  static constexpr uint64_t FrameWrap = 1ull << 61;
+  static constexpr uint64_t FrameSizeMask = (1ull << 56) - 1;
+
+  struct Frame {
+    uint64_t flags;
+    string body;
+  };
+
+  static size_t recordSize(size_t n) {
+    return sizeof(uint64_t) + ((n + 7) & ~(size_t)7);
+  }
+
+  void attach(ShmRing& out,
+              char* outData,
+              ShmRing& in,
+              char* inData,
+              size_t ringBytes,
+              ShmDoorbell& other) {
+    tx = &out;
+    txData = outData;
+    rx = &in;
+    rxData = inData;
+    mask = ringBytes - 1;
+    remote = &other;
+    txPos = tx->head.load(memory_order_relaxed);
+    txTail = tx->tail.load(memory_order_acquire);
+    rxPos = rx->tail.load(memory_order_relaxed);
+    token = make_shared<char>();
+  }
+
+  // frames still pinned by the receiver keep pointing into the mapping,
+  // which must outlive them.
+  void detach() {
+    tx = rx = nullptr;
+    backlog.clear();
+    backlogged = 0;
+    isWritable = true;
+    paused = false;
+    pins.clear();
+  }
+
+  bool put(const char* p, size_t n, uint64_t flags) {
+    auto ringBytes = mask + 1;
+    auto rec = recordSize(n);
+    auto off = txPos & mask;
+    auto toEnd = ringBytes - off;
+    auto need = rec <= toEnd ? rec : toEnd + rec;
+    // the reader's position is only fetched when the cached one says full,
+    // its cache line stays put otherwise.
+    if (ringBytes - (txPos - txTail) < need) {
+      txTail = tx->tail.load(memory_order_acquire);
+      if (ringBytes - (txPos - txTail) < need) {
+        // look again after asking to be woken, the reader may have moved on
+        // before it could see the flag.
+        tx->writerBlocked.store(1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        txTail = tx->tail.load(memory_order_acquire);
+        if (ringBytes - (txPos - txTail) < need)
+          return false;
+      }
+    }
+    if (rec > toEnd) {
+      memcpy(txData + off, &FrameWrap, sizeof(FrameWrap));
+      txPos += toEnd;
+      off = 0;
+    }
+    uint64_t h = n | flags;
+    memcpy(txData + off, &h, sizeof(h));
+    memcpy(txData + off + sizeof(h), p, n);
+    txPos += rec;
+    tx->head.store(txPos, memory_order_release);
+    return true;
+  }
+
+  void flushBacklog() {
+    size_t i = 0;
+    for (; i < backlog.size(); i++) {
+      auto& f = backlog[i];
+      if (!put(f.body.data(), f.body.size(), f.flags))
+        break;
+      backlogged -= f.body.size();
+    }
+    if (!i)
+      return;
+    backlog.erase(backlog.begin(), backlog.begin() + i);
+    remote->ring();
+    updateWritable();
+  }
+
+  void updateWritable() {
+    if (!watermarks.high)
+      return;
+    if (isWritable && backlogged > watermarks.high) {
+      isWritable = false;
+      onWritable(false);
+    } else if (!isWritable && backlogged <= watermarks.low) {
+      isWritable = true;
+      onWritable(true);
+    }
+    auto limit = watermarks.limit ? watermarks.limit : 8 * watermarks.high;
+    if (backlogged > limit)
+      onOverLimit();
+  }
+
+  // give the frame starting at `begin` back to the writer, unless the
+  // receiver pinned it: then it and everything after stays until unpinned.
+  void release(uint64_t begin) {
+    if (!rx)
+      return;
+    if (token.use_count() > 1) {
+      pins.push_back({move(token), begin});
+      token = make_shared<char>();
+    } else if (pins.empty()) {
+      publish(rxPos);
+    }
+  }
+
+  void releasePins() {
+    while (!pins.empty() && pins.front().first.use_count() == 1)
+      pins.pop_front();
+    if (rx)
+      publish(pins.empty() ? rxPos : pins.front().second);
+  }
+
+  void publish(uint64_t tail) {
+    rx->tail.store(tail, memory_order_release);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (rx->writerBlocked.load(memory_order_relaxed)) {
+      rx->writerBlocked.store(0, memory_order_relaxed);
+      remote->ring();
+    }
+  }
+
+  ShmRing* tx = nullptr;
+  ShmRing* rx = nullptr;
+  char* txData = nullptr;
+  char* rxData = nullptr;
+  size_t mask = 0;
+  ShmDoorbell* remote = nullptr;
+  uint64_t txPos = 0;
+  uint64_t txTail = 0;
+  uint64_t rxPos = 0;
+  vector<Frame> backlog;
+  size_t backlogged = 0;
+  bool isWritable = true;
+  bool paused = false;
+  // owner of the frames handed out, replaced when one gets pinned.
+  shared_ptr<const void> token;
+  deque<pair<shared_ptr<const void>, uint64_t>> pins;
+  Action<MemIStream&> receiver;
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+class ShmClient : public RpcClient<MemIStream, MemOStream>, public ShmPeer {
+ public:
+  ShmClient() : RpcClient(output) {}
+  ~ShmClient() { close(); }
+
+  // claim a free slot of the server's region `name`.
+  bool connect(const string& name) {
+    close();
+    if (!region.open(name))
+      return false;
+    header = (ShmHeader*)region.data();
+    if (header->magic.load(memory_order_acquire) != ShmHeader::Magic ||
+        region.size() <
+            ShmHeader::totalSize(header->slots, header->ringBytes) ||
+        !header->alive.load() || !imp::processAlive(header->owner)) {
+      close();
+      return false;
+    }
+    for (uint32_t i = 0; i < header->slots; i++) {
+      uint32_t expected = ShmSlot::Free;
+      if (header->slot(i).state.compare_exchange_strong(expected,
+                                                        ShmSlot::Open)) {
+        slot = (int)i;
+        break;
+      }
+    }
+    if (slot < 0) {
+      close();
+      return false;
+    }
+    auto& s = header->slot(slot);
+    s.owner.store(getpid(), memory_order_release);
+    attach(s.toServer, header->toServer(slot), s.toClient,
+           header->toClient(slot), header->ringBytes, header->server);
+    header->server.ring();
+
+    receive([this](MemIStream& in) { onReceive(in); });
+    flush = [this] { unsent = !send(output); };
+    return true;
+  }
+
+  // codec of the frames this client sends, replies come in whatever codec
+  // the server uses.
+  void setCodec(Codec c) { output.setCodec(c); }
+
+  bool connected() const { return slot >= 0; }
+
+  // dispatch the replies that arrived and expire calls past their deadline.
+  void update() {
+    if (slot < 0)
+      return;
+    auto now = std::chrono::steady_clock::now();
+    if (!poll() && slot >= 0 && !serverAlive(now))
+      onError(asio::error::eof);
+    if (hasDeadlines() && now - lastExpire >= TimerTick) {
+      lastExpire = now;
+      expire(now);
+    }
+  }
+
+  // wait up to `timeout` for replies, then dispatch them.
+  void wait(std::chrono::nanoseconds timeout) {
+    if (slot < 0)
+      return;
+    auto& s = header->slot(slot);
+    imp::shmWait(s.client, waiting.spin, waiting.busyPoll, timeout, [&] {
+      return ready() || s.state.load(memory_order_relaxed) != ShmSlot::Open;
+    });
+    update();
+  }
+
+  void onError(const error_code& err) override {
+    ShmPeer::onError(err);
+    close();
+  }
+
+  // hang up, pending calls and streams end with Status::Cancelled.
+  void close() {
+    if (slot >= 0) {
+      header->slot(slot).state.store(ShmSlot::Closed, memory_order_release);
+      header->server.ring();
+      slot = -1;
+    }
+    detach();
+    header = nullptr;
+    region.close();
+    connectionLost();
+  }
+
+ private:
+  ShmRegion region;
+  ShmHeader* header = nullptr;
+  int slot = -1;
+  MemOStream output;
+  std::chrono::steady_clock::time_point lastExpire, lastLivenessCheck;
+
+  // the server neither closed the slot nor died.
+  bool serverAlive(std::chrono::steady_clock::time_point now) {
+    if (header->slot(slot).state.load(memory_order_acquire) != ShmSlot::Open)
+      return false;
+    if (now - lastLivenessCheck < ShmHeader::LivenessCheck)
+      return true;
+    lastLivenessCheck = now;
+    return imp::processAlive(header->owner);
+  }
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+// Serves every client of one region from the thread calling update() or
+// wait(). Handler functions running on the worker pool hand their replies
+// back through post(), which wakes wait() up.
+class ShmServer : public RpcServer<MemIStream, MemOStream> {
+ public:
+  // connections the region has room for.
+  int slots = 16;
+  // size of each ring, rounded up to a power of two. A frame may take at most
+  // half of it.
+  size_t ringBytes = 256 * 1024;
+  ShmPeer::Waiting waiting;
+  // copied to every session when it opens.
+  ShmPeer::Watermarks watermarks;
+  Codec codec = Codec::Raw;
+
+  ~ShmServer() { stop(); }
+
+  // create the region clients connect to, false if `name` is taken by a
+  // server still running. The region of one that died is replaced; one that
+  // died before it finished creating it leaves a region to shm_unlink().
+  bool listen(const string& name) {
+    stop();
+    size_t rb = 4096;
+    while (rb < ringBytes)
+      rb *= 2;
+    auto size = ShmHeader::totalSize(slots, rb);
+    if (!region.create(name, size)) {
+      if (errno != EEXIST || !abandoned(name))
+        return false;
+      shm_unlink(name.c_str());
+      if (!region.create(name, size))
+        return false;
+    }
+    header = new (region.data()) ShmHeader();
+    header->slots = slots;
+    header->ringBytes = rb;
+    header->owner = getpid();
+    for (int i = 0; i < slots; i++)
+      new (&header->slot(i)) ShmSlot();
+    header->magic.store(ShmHeader::Magic, memory_order_release);
+
+    sessions.clear();
+    for (int i = 0; i < slots; i++)
+      sessions.push_back(make_unique<Session>(this, i));
+    setShards(1, slots);
+
+    flush = [this](SessionID sid) {
+      auto s = findSession(sid);
+      if (s && !s->send(s->os))
+        onError(asio::error::message_size, s);
+    };
+    if (watermarks.high) {
+      writable = [this](SessionID sid) {
+        auto s = findSession(sid);
+        return s && s->writable();
+      };
+    }
+    post = [this](SessionID, Action<> f) {
+      {
+        lock_guard<mutex> l(taskLock);
+        tasks.push_back(move(f));
+        hasTasks = true;
+      }
+      if (header)
+        header->server.ring();
+    };
+    return true;
+  }
+
+  void stop() {
+    if (!header)
+      return;
+    header->alive.store(0);
+    for (auto& s : sessions) {
+      if (!s->closed)
+        close(s.get());
+    }
+    sessions.clear();
+    header = nullptr;
+    region.close();
+  }
+
+  struct Session : ShmPeer {
+    SessionID sid = -1;
+    int slot;
+    SessionID generation = 0;
+    bool closed = true;
+    MemOStream os;
+    ShmServer* server;
+
+    Session(ShmServer* s, int slot) : slot(slot), server(s) {}
+    using ShmPeer::attach;
+    using ShmPeer::detach;
+    void onError(const error_code& err) override { server->onError(err, this); }
+    void onWritable(bool w) override { server->onWritable(w, this); }
+    void onOverLimit() override { server->close(this); }
+  };
+
+  void onError(const error_code& err, Session* s) {
+    printf("%s\n", err.message().c_str());
+    close(s);
+  }
+
+  void onWritable(bool w, Session* s) {
+    if (s->closed)
+      return;
+    if (overflow == Overflow::Disconnect && !w) {
+      close(s);
+      return;
+    }
+    if (overflow == Overflow::Block)
+      w ? s->resumeReceive() : s->pauseReceive();
+    sessionWritable(s->sid, w);
+  }
+
+  void close(SessionID sid) {
+    if (auto s = findSession(sid))
+      close(s);
+  }
+
+  // accept new clients, dispatch what arrived and reap closed slots, and
+  // those of clients that died.
+  void update() {
+    if (!header)
+      return;
+    if (hasTasks.load(memory_order_acquire))
+      runTasks();
+    auto now = std::chrono::steady_clock::now();
+    if (now - lastLivenessCheck >= ShmHeader::LivenessCheck) {
+      lastLivenessCheck = now;
+      reapDead();
+    }
+    for (auto& sp : sessions) {
+      auto s = sp.get();
+      if (!s->closed) {
+        if (s->poll())
+          continue;
+      }
+      auto& slot = header->slot(s->slot);
+      switch (slot.state.load(memory_order_acquire)) {
+        case ShmSlot::Open:
+          if (s->closed)
+            open(s);
+          break;
+        case ShmSlot::Closed:
+          if (!s->closed)
+            close(s);
+          reclaim(s);
+          break;
+        default:
+          break;
+      }
+    }
+  }
+
+  // wait up to `timeout` for a client to connect, send or leave, then
+  // update().
+  void wait(std::chrono::nanoseconds timeout) {
+    if (!header)
+      return;
+    imp::shmWait(header->server, waiting.spin, waiting.busyPoll, timeout,
+                 [this] { return pending(); });
+    update();
+  }
+
+ private:
+  // `name` is a region whose server died.
+  static bool abandoned(const string& name) {
+    ShmRegion r;
+    if (!r.open(name))
+      return false;
+    auto h = (ShmHeader*)r.data();
+    return h->magic.load(memory_order_acquire) == ShmHeader::Magic &&
+           !imp::processAlive(h->owner);
+  }
+
+  // a client that died never lets go of its slot.
+  void reapDead() {
+    for (auto& s : sessions) {
+      auto& slot = header->slot(s->slot);
+      auto state = slot.state.load(memory_order_acquire);
+      if (state != ShmSlot::Open && state != ShmSlot::Closing)
+        continue;
+      if (imp::processAlive(slot.owner.load(memory_order_acquire)))
+        continue;
+      close(s.get());
+      reclaim(s.get());
+    }
+  }
+
+  // something for update() to do.
+  bool pending() {
+    if (hasTasks.load(memory_order_relaxed))
+      return true;
+    for (auto& s : sessions) {
+      auto state = header->slot(s->slot).state.load(memory_order_relaxed);
+      if (s->closed ? state == ShmSlot::Open || state == ShmSlot::Closed
+                    : state != ShmSlot::Open || s->ready())
+        return true;
+    }
+    return false;
+  }
+
+  Session* findSession(SessionID sid) {
+    if (sid < 0 || sessions.empty())
+      return nullptr;
+    auto s = sessions[sid % sessions.size()].get();
+    return s->sid == sid && !s->closed ? s : nullptr;
+  }
+
+  void open(Session* s) {
+    auto i = s->slot;
+    auto& slot = header->slot(i);
+    s->generation = (s->generation + 1) % (INT64_MAX / slots);
+    s->sid = s->generation * slots + i;
+    s->closed = false;
+    s->waiting = waiting;
+    s->watermarks = watermarks;
+    s->os.setCodec(codec);
+    s->attach(slot.toClient, header->toClient(i), slot.toServer,
+              header->toServer(i), header->ringBytes, slot.client);
+    addSession(s->sid, s->os);
+    s->receive([this, sid = s->sid](MemIStream& in) { onReceive(sid, in); });
+  }
+
+  // stop serving the slot, the client lets go of it in its next update().
+  void close(Session* s) {
+    if (s->closed)
+      return;
+    s->closed = true;
+    auto& slot = header->slot(s->slot);
+    uint32_t expected = ShmSlot::Open;
+    slot.state.compare_exchange_strong(expected, ShmSlot::Closing);
+    slot.client.ring();
+    s->detach();
+    s->os.reset();
+    removeSession(s->sid);
+  }
+
+  // the client let go, rewind the rings for the next one.
+  void reclaim(Session* s) {
+    auto& slot = header->slot(s->slot);
+    for (auto r : {&slot.toServer, &slot.toClient}) {
+      r->head.store(0, memory_order_relaxed);
+      r->tail.store(0, memory_order_relaxed);
+    }
+    slot.owner.store(0, memory_order_relaxed);
+    slot.state.store(ShmSlot::Free, memory_order_release);
+  }
+
+  void runTasks() {
+    vector<Action<>> run;
+    {
+      lock_guard<mutex> l(taskLock);
+      run.swap(tasks);
+      hasTasks = false;
+    }
+    for (auto& f : run)
+      f();
+  }
+
+  ShmRegion region;
+  ShmHeader* header = nullptr;
+  vector<unique_ptr<Session>> sessions;
+  std::chrono::steady_clock::time_point lastLivenessCheck;
+  mutex taskLock;
+  vector<Action<>> tasks;
+  atomic<bool> hasTasks{false};
+};
+
+}  // namespace trpc
+
+#endif
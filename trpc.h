@@ -6,10 +6,27 @@
 //////////////////////////////////////////////////////////////////////////
 
 #pragma once
+#include <chrono>
+#include <climits>
+#include <cstdint>
 #include <functional>
+#include <istream>
 #include <map>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <tuple>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#if __has_include(<span>)
+#include <span>
+#endif
+
+#include "awaitable.h"
+#include "requestTable.h"
+#include "trpcMetrics.h"
+#include "workerPool.h"
 
 //#define TPRC_DELIMITER(n)  n << ' '
 #ifndef TPRC_DELIMITER
@@ -20,8 +37,12 @@ namespace trpc {
 
 using std::function;
 using std::map;
+using std::unique_ptr;
 using std::string;
 using std::tuple;
+using std::unordered_map;
+using std::unordered_set;
+using std::vector;
 
 namespace imp {
 using namespace std;
@@ -81,6 +102,13 @@ struct is_lambda<T, void_t<decltype(&T::operator())>> : true_type {};
 template <typename T>
 constexpr bool is_lambda_v = is_lambda<T>::value;
 
+template <typename... A>
+constexpr bool last_is_lambda_v = false;
+
+template <typename A0, typename... A>
+constexpr bool last_is_lambda_v<A0, A...> =
+    is_lambda_v<tuple_element_t<sizeof...(A), tuple<A0, A...>>>;
+
 template <typename Tuple>
 struct ArgsTrait {
   static constexpr auto Cnt = tuple_size_v<Tuple>;
@@ -94,23 +122,339 @@ struct ArgsTrait {
 template <typename E,
           typename S,
           typename = std::enable_if_t<std::is_enum_v<E>>>
-S& operator>>(S& s, E& e) {
-  return s >> (std::underlying_type_t<E>&)(e);
+auto operator>>(S& s, E& e)
+    -> decltype(s >> std::declval<std::underlying_type_t<E>&>()) {
+  // read into a real underlying object, writing through a cast reference
+  // breaks strict aliasing.
+  auto v = (std::underlying_type_t<E>)e;
+  decltype(auto) r = s >> v;
+  e = (E)v;
+  return r;
 }
 
 template <typename E,
           typename S,
           typename = std::enable_if_t<std::is_enum_v<E>>>
-S& operator<<(S& s, E e) {
+auto operator<<(S& s, E e) -> decltype(s << (std::underlying_type_t<E>)(e)) {
   return s << (std::underlying_type_t<E>)(e);
 }
 
+//////////////////////////////////////////////////////////////////////////
+/// aggregate reflection
+
+constexpr size_t MaxFields = 16;
+
+// stands in for any field of T when probing how many initializers T takes.
+template <typename T>
+struct AnyField {
+  template <typename U, typename = enable_if_t<!is_same_v<decay_t<U>, T>>>
+  operator U() const;
+};
+
+template <typename T, typename... A>
+auto braceInit(int) -> decltype(T{declval<A>()...}, true_type{});
+template <typename T, typename... A>
+false_type braceInit(...);
+
+template <typename T, typename... A>
+constexpr size_t fieldCount() {
+  if constexpr (sizeof...(A) > MaxFields ||
+                !decltype(braceInit<T, A..., AnyField<T>>(0))::value)
+    return sizeof...(A);
+  else
+    return fieldCount<T, A..., AnyField<T>>();
+}
+
+template <typename T, class = void_t<>>
+struct is_tuple_like : false_type {};
+
+template <typename T>
+struct is_tuple_like<T, void_t<decltype(tuple_size<T>::value)>> : true_type {};
+
+// plain structs without bases or C array members, up to MaxFields fields.
+// tuple-like aggregates such as std::array keep their own operators.
+template <typename T>
+constexpr bool reflectable() {
+  if constexpr (is_class_v<T> && is_aggregate_v<T> && !is_tuple_like<T>::value)
+    return fieldCount<T>() <= MaxFields;
+  else
+    return false;
+}
+
+// the fields of `v` as a tuple of references.
+template <typename T>
+auto fieldsOf(T& v) {
+  constexpr auto N = fieldCount<remove_const_t<T>>();
+  // clang-format off
+#define TRPC_FIELDS(n, ...) \
+  if constexpr (N == n) { auto& [__VA_ARGS__] = v; return forward_as_tuple(__VA_ARGS__); } else
+  TRPC_FIELDS(1, a)
+  TRPC_FIELDS(2, a, b)
+  TRPC_FIELDS(3, a, b, c)
+  TRPC_FIELDS(4, a, b, c, d)
+  TRPC_FIELDS(5, a, b, c, d, e)
+  TRPC_FIELDS(6, a, b, c, d, e, f)
+  TRPC_FIELDS(7, a, b, c, d, e, f, g)
+  TRPC_FIELDS(8, a, b, c, d, e, f, g, h)
+  TRPC_FIELDS(9, a, b, c, d, e, f, g, h, i)
+  TRPC_FIELDS(10, a, b, c, d, e, f, g, h, i, j)
+  TRPC_FIELDS(11, a, b, c, d, e, f, g, h, i, j, k)
+  TRPC_FIELDS(12, a, b, c, d, e, f, g, h, i, j, k, l)
+  TRPC_FIELDS(13, a, b, c, d, e, f, g, h, i, j, k, l, m)
+  TRPC_FIELDS(14, a, b, c, d, e, f, g, h, i, j, k, l, m, n_)
+  TRPC_FIELDS(15, a, b, c, d, e, f, g, h, i, j, k, l, m, n_, o)
+  TRPC_FIELDS(16, a, b, c, d, e, f, g, h, i, j, k, l, m, n_, o, p)
+  return tuple<>();
+#undef TRPC_FIELDS
+  // clang-format on
+}
+
+// streams that put arithmetic values on the wire as their in-memory bytes
+// say so through rawLayout(), letting back-to-back fields be copied at once.
+template <typename S, class = void_t<>>
+struct has_raw_layout : false_type {};
+
+template <typename S>
+struct has_raw_layout<S, void_t<decltype(declval<S&>().rawLayout())>>
+    : true_type {};
+
+template <typename S>
+bool rawLayout(S& s) {
+  if constexpr (has_raw_layout<S>::value)
+    return s.rawLayout();
+  else
+    return false;
+}
+
+template <typename T>
+constexpr bool is_raw_field_v = is_arithmetic_v<T> && !is_same_v<T, bool>;
+
+// Walks the fields of an aggregate, nested ones included. On raw layout
+// streams a field starting where the previous one ended extends the current
+// run and each run is copied as one block.
+template <typename S>
+struct FieldWriter {
+  S& s;
+  bool raw;
+  const char* begin = nullptr;
+  size_t len = 0;
+
+  template <typename F>
+  void operator()(const F& f) {
+    if constexpr (reflectable<F>()) {
+      tuple_for(fieldsOf(f), *this);
+    } else if constexpr (is_raw_field_v<F> && has_raw_layout<S>::value) {
+      if (raw) {
+        auto p = (const char*)&f;
+        if (p != begin + len) {
+          flush();
+          begin = p;
+        }
+        len += sizeof(F);
+      } else {
+        s << f;
+      }
+    } else {
+      flush();
+      s << TPRC_DELIMITER(f);
+    }
+  }
+
+  void flush() {
+    if constexpr (has_raw_layout<S>::value) {
+      if (len)
+        s.write(begin, len);
+      len = 0;
+    }
+  }
+};
+
+template <typename S>
+struct FieldReader {
+  S& s;
+  bool raw;
+  char* begin = nullptr;
+  size_t len = 0;
+  bool ok = true;
+
+  template <typename F>
+  void operator()(F& f) {
+    if constexpr (reflectable<F>()) {
+      tuple_for(fieldsOf(f), *this);
+    } else if constexpr (is_raw_field_v<F> && has_raw_layout<S>::value) {
+      if (raw) {
+        auto p = (char*)&f;
+        if (p != begin + len) {
+          flush();
+          begin = p;
+        }
+        len += sizeof(F);
+      } else {
+        ok = ok && (s >> f);
+      }
+    } else {
+      flush();
+      if constexpr (is_same_v<decltype(s >> f), bool>)
+        ok = ok && (s >> f);
+      else
+        s >> f;
+    }
+  }
+
+  void flush() {
+    if constexpr (has_raw_layout<S>::value) {
+      if (len)
+        ok = ok && s.read(begin, (int)len);
+      len = 0;
+    }
+  }
+};
+
+//////////////////////////////////////////////////////////////////////////
+/// frame views
+
+// argument types pointing into the request frame instead of owning a copy.
+template <typename T>
+struct is_view : false_type {};
+
+template <typename C, typename Tr>
+struct is_view<basic_string_view<C, Tr>> : true_type {};
+
+#ifdef __cpp_lib_span
+template <typename T, size_t N>
+struct is_view<span<T, N>> : true_type {};
+#endif
+
+template <typename Tuple>
+struct has_view;
+
+template <typename... A>
+struct has_view<tuple<A...>> : bool_constant<(... || is_view<A>::value)> {};
+
+template <typename S, class = void_t<>>
+struct has_pin : false_type {};
+
+template <typename S>
+struct has_pin<S, void_t<decltype(declval<S&>().pin())>> : true_type {};
+
+// result of `s >> v`, streams that can't tell are taken as good.
+template <typename R>
+bool readOk(R&& r) {
+  if constexpr (is_constructible_v<bool, R>)
+    return (bool)r;
+  else
+    return true;
+}
+
+// keeps the frame behind `i` alive while arguments of type Args view it.
+template <typename Args, typename S>
+shared_ptr<const void> framePin(S& i) {
+  if constexpr (has_view<Args>::value && has_pin<S>::value)
+    return i.pin();
+  else
+    return nullptr;
+}
+
 }  // namespace imp
 
-using SessionID = int;
+// true if another message follows in the same frame. Other stream types
+// provide their own overload next to their operators.
+template <typename C, typename T>
+bool hasMore(std::basic_istream<C, T>& s) {
+  s >> std::ws;
+  return s.good() && s.peek() != T::eof();
+}
+
+// positions in a frame, to count the bytes of requests and replies. Other
+// stream types provide their own overloads too.
+template <typename C, typename T>
+size_t readOffset(std::basic_istream<C, T>& s) {
+  auto p = s.tellg();
+  return p < 0 ? 0 : (size_t)p;
+}
+
+template <typename C, typename T>
+size_t writeOffset(std::basic_ostream<C, T>& s) {
+  auto p = s.tellp();
+  return p < 0 ? 0 : (size_t)p;
+}
+
+// ask the transport to compress what was written, for streams that can.
+template <typename C, typename T>
+void markCompressible(std::basic_ostream<C, T>&) {}
+
+namespace imp {
+inline size_t distance(size_t from, size_t to) {
+  return to > from ? to - from : 0;
+}
+}  // namespace imp
+
+//////////////////////////////////////////////////////////////////////////
+// Aggregates without their own operators are written field by field, in
+// declaration order, and found through ADL next to the stream types here.
+
+template <typename S,
+          typename T,
+          typename = std::enable_if_t<imp::reflectable<T>()>>
+auto operator<<(S& s, const T& v) -> decltype(s << 0) {
+  imp::FieldWriter<S> w{s, imp::rawLayout(s)};
+  w(v);
+  w.flush();
+  if constexpr (std::is_same_v<decltype(s << 0), bool>)
+    return true;
+  else
+    return s;
+}
+
+template <typename S,
+          typename T,
+          typename = std::enable_if_t<imp::reflectable<T>()>>
+auto operator>>(S& s, T& v) -> decltype(s >> std::declval<int&>()) {
+  imp::FieldReader<S> r{s, imp::rawLayout(s)};
+  r(v);
+  r.flush();
+  if constexpr (std::is_same_v<decltype(s >> std::declval<int&>()), bool>)
+    return r.ok;
+  else
+    return s;
+}
+
+// 64 bits so a server never hands out the sid of a connection it served
+// before, however many times it recycles the session behind it.
+using SessionID = int64_t;
 using SessionCb = function<void(SessionID)>;
+using SessionTask = function<void(SessionID, function<void()>)>;
+// a frame encoded once and queued as is on any number of sessions.
+using SharedFrame = std::shared_ptr<const string>;
+
+// where a handler function runs: on the thread that received the request, or
+// on the server's worker pool with the reply handed back to the session's
+// own thread.
+enum class Exec {
+  Inline,
+  Pool,
+};
+
+// what happens to a session whose outbound backlog passed its high
+// watermark: stop reading its requests until the backlog drains, keep
+// serving it but drop notifies to it, or hang up. Notifies, multicasts and
+// publishes can't be paused: under Block they keep queueing up to the
+// transport's hard limit, past which the session is hung up on.
+enum class Overflow {
+  Block,
+  DropNotifies,
+  Disconnect,
+};
 
 enum class RequestType : int {
+  // followed by the id of a stream and then by a chunk of it, by chunks
+  // its reader has room for, or by the Status ending it.
+  StreamCredit = -5,
+  StreamEnd = -4,
+  StreamChunk = -3,
+  // followed by the time left in ms and then the request it applies to.
+  Deadline = -2,
+  MethodCall = -1,
   Notify = 1,
   Call,
   CallResponse,
@@ -120,6 +464,346 @@ enum class RequestType : int {
 template <typename... A>
 using RespCb = function<void(A...)>;
 
+// Outcome of a call, for callbacks taking a Status as their first parameter.
+// Callbacks without one are only called on success.
+enum class Status {
+  Ok,
+  Timeout,
+  // a stream its writer ended with an error, or a request that couldn't be
+  // sent as all its ids are in use.
+  Failed,
+  // a stream either end gave up on, or a call whose connection was lost.
+  Cancelled,
+};
+
+using Deadline = std::chrono::steady_clock::time_point;
+
+namespace imp {
+template <typename T>
+constexpr bool takes_status_v = false;
+
+template <typename... A>
+constexpr bool takes_status_v<tuple<Status, A...>> = true;
+
+// fill the arguments of a response callback, from `i` unless the call
+// failed. False if the callback isn't to be called.
+template <typename Args, typename S>
+bool readResponse(Args& args, Status st, S* i) {
+  if constexpr (takes_status_v<Args>) {
+    get<0>(args) = st;
+    if (i)
+      tuple_for(tuple_slice<1, tuple_size_v<Args>>(args),
+                [&](auto& a) { *i >> a; });
+    return true;
+  } else {
+    if (!i)
+      return false;
+    tuple_for(args, [&](auto& a) { *i >> a; });
+    return true;
+  }
+}
+
+// first value of a response, past the Status if there is one.
+template <typename Args>
+void* firstResult(Args& args) {
+  constexpr size_t i = takes_status_v<Args> ? 1 : 0;
+  if constexpr (i < tuple_size_v<Args>)
+    return &get<i>(args);
+  else
+    return nullptr;
+}
+}  // namespace imp
+
+//////////////////////////////////////////////////////////////////////////
+// streams
+
+namespace imp {
+// One end of a stream, shared by the handles the application holds and the
+// session or client it runs on. The writer sends chunks while it has
+// credit, the reader grants more as it takes them in, so at most a window
+// of chunks is in flight. Either end may end the stream. A reader giving
+// up still decodes and drops chunks until the writer's end arrives.
+template <typename istream, typename ostream>
+struct StreamState {
+  int id = 0;
+  bool writer = false;
+  bool open = true;
+  // writer: chunks the reader has room for.
+  int credit = 0;
+  function<void()> onReady;
+  // reader: chunks taken in since credit was last granted.
+  int window = 0, taken = 0;
+  function<void(istream&, bool deliver)> onChunk;
+  function<void(Status, const string&)> onEnd;
+  // set by the end owning the connection: its output, null once gone, how
+  // to send what was written, and what to do once the stream is over here.
+  function<ostream*()> output;
+  function<void()> flush;
+  function<void(Status)> closed;
+  size_t bytes = 0;
+
+  template <typename... T>
+  void write(const T&... chunk) {
+    auto o = open ? output() : nullptr;
+    if (!o)
+      return;
+    auto begin = writeOffset(*o);
+    *o << TPRC_DELIMITER((int)RequestType::StreamChunk);
+    *o << TPRC_DELIMITER(id);
+    (..., (*o << TPRC_DELIMITER(chunk)));
+    bytes += distance(begin, writeOffset(*o));
+    credit--;
+    flush();
+  }
+
+  // by the writer when done, by the reader giving up.
+  void end(Status st, const string& error = {}) {
+    if (!open)
+      return;
+    open = false;
+    send(RequestType::StreamEnd, st, error);
+    if (writer) {
+      finish(st);
+    } else if (onEnd) {
+      auto f = std::move(onEnd);
+      f(st, error);
+    }
+  }
+
+  void received(RequestType type, istream& i) {
+    if (type == RequestType::StreamChunk) {
+      onChunk(i, open);
+      if (open && ++taken >= std::max(1, window / 2)) {
+        send(RequestType::StreamCredit, taken);
+        taken = 0;
+      }
+    } else if (type == RequestType::StreamCredit) {
+      int n;
+      i >> n;
+      credit += n;
+      if (open && onReady) {
+        auto f = onReady;
+        f();
+      }
+    } else {
+      int st;
+      string error;
+      i >> st;
+      if ((Status)st == Status::Failed)
+        i >> error;
+      if (!open) {
+        finish((Status)st);
+      } else if (writer) {
+        // the reader gave up, tell it when it can forget the stream.
+        open = false;
+        send(RequestType::StreamEnd, Status::Cancelled, string());
+        stopped();
+        finish(Status::Cancelled);
+      } else {
+        open = false;
+        if (onEnd) {
+          auto f = std::move(onEnd);
+          f((Status)st, error);
+        }
+        finish((Status)st);
+      }
+    }
+  }
+
+  // the connection went away.
+  void lost() {
+    if (open) {
+      open = false;
+      if (writer) {
+        stopped();
+      } else if (onEnd) {
+        auto f = std::move(onEnd);
+        f(Status::Cancelled, {});
+      }
+    }
+    finish(Status::Cancelled);
+  }
+
+  // the reader has room for `n` more chunks.
+  void grant(int n) { send(RequestType::StreamCredit, n); }
+
+ private:
+  template <typename... A>
+  void send(RequestType type, A... a) {
+    auto o = output ? output() : nullptr;
+    if (!o)
+      return;
+    *o << TPRC_DELIMITER((int)type);
+    *o << TPRC_DELIMITER(id);
+    put(*o, a...);
+    flush();
+  }
+  void put(ostream& o, int n) { o << TPRC_DELIMITER(n); }
+  void put(ostream& o, Status st, const string& error) {
+    o << TPRC_DELIMITER((int)st);
+    if (st == Status::Failed)
+      o << TPRC_DELIMITER(error);
+  }
+
+  // let a writer waiting for credit see it won't come.
+  void stopped() {
+    if (onReady) {
+      auto f = std::move(onReady);
+      f();
+    }
+  }
+
+  // the stream is over at this end. The callbacks go too, they often hold
+  // a handle of the stream.
+  void finish(Status st) {
+    if (closed) {
+      auto f = std::move(closed);
+      f(st);
+    }
+    onReady = nullptr;
+    onEnd = nullptr;
+  }
+};
+
+template <typename istream, typename ostream>
+using Streams = unordered_map<int, shared_ptr<StreamState<istream, ostream>>>;
+
+inline bool isStreamMessage(int type) {
+  return type >= (int)RequestType::StreamCredit &&
+         type <= (int)RequestType::StreamChunk;
+}
+
+// false if the rest of the frame can't be trusted: a chunk of an unknown
+// stream can't be skipped.
+template <typename istream, typename ostream>
+bool dispatchStream(int type,
+                    istream& i,
+                    Streams<istream, ostream>& streams) {
+  int id;
+  i >> id;
+  auto it = streams.find(id);
+  if (it == streams.end()) {
+    if (type == (int)RequestType::StreamChunk)
+      return false;
+    // credit or the end of a stream this end is done with already.
+    StreamState<istream, ostream> gone;
+    gone.open = false;
+    gone.received((RequestType)type, i);
+    return true;
+  }
+  // kept alive while it ends and leaves `streams`.
+  auto s = it->second;
+  s->received((RequestType)type, i);
+  return true;
+}
+}  // namespace imp
+
+// Writing end of a stream, a handle to copy into callbacks. Write while
+// ready(): the reader has room for that many chunks and onReady is called
+// when it grants more. Writing past that works, but then nothing bounds
+// the chunks held on the way.
+template <typename istream, typename ostream, typename... T>
+class StreamWriter {
+ public:
+  using State = imp::StreamState<istream, ostream>;
+
+  StreamWriter() {}
+  explicit StreamWriter(std::shared_ptr<State> s) : state(std::move(s)) {}
+
+  bool ready() const { return state && state->open && state->credit > 0; }
+  // false once ended, given up by the reader or its connection is gone.
+  bool open() const { return state && state->open; }
+  void write(const T&... chunk) {
+    if (state)
+      state->write(chunk...);
+  }
+  void end() {
+    if (state)
+      state->end(Status::Ok);
+  }
+  void fail(const string& error) {
+    if (state)
+      state->end(Status::Failed, error);
+  }
+  // called when credit comes back, and once if the stream closes before
+  // the writer ended it.
+  void onReady(function<void()> f) {
+    if (state)
+      state->onReady = std::move(f);
+  }
+
+ private:
+  std::shared_ptr<State> state;
+};
+
+// Reading end of a stream, a handle to copy into callbacks.
+template <typename istream, typename ostream, typename... T>
+class StreamReader {
+ public:
+  using State = imp::StreamState<istream, ostream>;
+
+  StreamReader() {}
+  explicit StreamReader(std::shared_ptr<State> s) : state(std::move(s)) {
+    onChunk(nullptr);
+  }
+
+  // called with every chunk until the stream ends.
+  void onChunk(function<void(T...)> f) {
+    if (!state)
+      return;
+    // set right away: chunks are decoded even when no one takes them.
+    state->onChunk = [f](istream& i, bool deliver) {
+      tuple<T...> chunk;
+      imp::tuple_for(chunk, [&](auto& a) { i >> a; });
+      if (deliver && f)
+        std::apply(f, chunk);
+    };
+  }
+  // called once: Ok when the writer ended the stream, Failed with its
+  // error, Cancelled when it was given up or its connection is gone.
+  void onEnd(function<void(Status, const string&)> f) {
+    if (state)
+      state->onEnd = std::move(f);
+  }
+  bool open() const { return state && state->open; }
+  void cancel() {
+    if (state)
+      state->end(Status::Cancelled);
+  }
+
+ private:
+  std::shared_ptr<State> state;
+};
+
+namespace imp {
+template <typename T>
+constexpr bool is_stream_writer_v = false;
+template <typename I, typename O, typename... T>
+constexpr bool is_stream_writer_v<StreamWriter<I, O, T...>> = true;
+
+template <typename T>
+constexpr bool is_stream_reader_v = false;
+template <typename I, typename O, typename... T>
+constexpr bool is_stream_reader_v<StreamReader<I, O, T...>> = true;
+
+// the reader of chunks a callback taking `Tuple` is called with.
+template <typename I, typename O, typename Tuple>
+struct ReaderOf;
+template <typename I, typename O, typename... A>
+struct ReaderOf<I, O, tuple<A...>> {
+  using type = StreamReader<I, O, decay_t<A>...>;
+};
+
+template <typename Tuple>
+constexpr bool has_stream_v = false;
+template <typename... A>
+constexpr bool has_stream_v<tuple<A...>> =
+    (... || (is_stream_reader_v<A> || is_stream_writer_v<A>));
+}  // namespace imp
+
+// name of the built-in handler serving framework requests like "$.resolve".
+constexpr const char* BuiltinHandlerName = "$";
+
 template <typename istream, typename ostream>
 class RpcServer;
 
@@ -128,8 +812,15 @@ class RpcServer;
 template <typename istream, typename ostream = istream>
 class Handler {
  public:
-  using Func = function<void(SessionID, int, istream&, ostream&)>;
+  using Func = function<void(SessionID, int, Deadline, istream&, ostream&)>;
   using Server = RpcServer<istream, ostream>;
+  // stream arguments of handler functions: a Writer last instead of the
+  // response callback streams the results, a Reader takes a stream the
+  // caller writes.
+  template <typename... T>
+  using Writer = StreamWriter<istream, ostream, T...>;
+  template <typename... T>
+  using Reader = StreamReader<istream, ostream, T...>;
 
   string name;
 
@@ -137,10 +828,19 @@ class Handler {
   virtual ~Handler() {}
 
   virtual void init() {}
-  virtual void onDisconnected(SessionID sid) {}
-
-  void onRequest(SessionID sid, string name, int rid, istream& i, ostream& o) {
-    funcs[name](sid, rid, i, o);
+  virtual void onDisconnected(SessionID) {}
+
+  bool onRequest(SessionID sid,
+                 string name,
+                 int rid,
+                 Deadline deadline,
+                 istream& i,
+                 ostream& o) {
+    auto it = funcs.find(name);
+    if (it == funcs.end())
+      return false;
+    it->second(sid, rid, deadline, i, o);
+    return true;
   }
 
   template <typename C, typename R, typename... A>
@@ -153,7 +853,66 @@ class Handler {
   template <typename Func>
   void addFunction(string name, Func&& f) {
     using namespace imp;
-    using Args = typename FuncTrait<Func>::Args;
+    using Args = typename FuncTrait<decay_t<Func>>::Args;
+    if constexpr (is_stream_writer_v<
+                      tuple_element_t<tuple_size_v<Args> - 1, Args>>)
+      addStream(name, std::forward<Func>(f));
+    else
+      addCall(name, std::forward<Func>(f));
+  }
+
+  // Handler functions touching shared state from Exec::Pool must do their
+  // own locking. Without a worker pool everything runs inline.
+  void setExec(Exec e) {
+    exec = e;
+    for (auto& i : infos)
+      i.second.exec = e;
+  }
+  void setExec(string name, Exec e) { infoOf(name).exec = e; }
+  // compress the replies of function `name` whatever their size, for
+  // transports that compress frames.
+  void setCompress(string name, bool on = true) { infoOf(name).compress = on; }
+  // index of `name` in the server's metrics.
+  void setMethod(string name, int method) { infoOf(name).method = method; }
+
+  void setServer(Server* s) { server = s; }
+  const map<string, Func>& getFunctions() const { return funcs; }
+
+ protected:
+  Server* server;
+
+ private:
+  struct FuncInfo {
+    Exec exec = Exec::Inline;
+    int method = -1;
+    bool compress = false;
+  };
+
+  // the entry of function `name`, made on the handler's Exec the first time.
+  FuncInfo& infoOf(const string& name) {
+    return infos.emplace(name, FuncInfo{exec}).first->second;
+  }
+
+  // the arguments past the SessionID. Streams the caller writes are opened
+  // instead of read.
+  template <typename Tuple>
+  bool readArgs(Tuple& args, SessionID sid, int reqID, istream& i) {
+    using namespace imp;
+    bool decoded = true;
+    tuple_for(tuple_slice<1, tuple_size_v<Tuple>>(args), [&](auto& e) {
+      using E = std::decay_t<decltype(e)>;
+      if constexpr (is_stream_reader_v<E>)
+        e = E(server->openStream(sid, reqID, false));
+      else if (!readOk(i >> e))
+        decoded = false;
+    });
+    return decoded;
+  }
+
+  template <typename Func>
+  void addCall(string name, Func&& f) {
+    using namespace imp;
+    using Args = typename FuncTrait<decay_t<Func>>::Args;
     using F = ArgsTrait<Args>;
 
     static_assert(is_same_v<tuple_element_t<0, Args>, SessionID>,
@@ -161,28 +920,131 @@ class Handler {
     static_assert(is_lambda_v<tuple_element_t<tuple_size_v<Args> - 1, Args>>,
                   "last param should be a lambda");
 
-    funcs[name] = [=](SessionID sid, int reqID, istream& i, ostream& o) {
+    auto info = &infoOf(name);
+    funcs[name] = [=](SessionID sid, int reqID, Deadline deadline, istream& i,
+                      ostream& o) {
       typename F::ArgsNoCb args;
+      auto call = server->metrics.begin(info->method);
+      auto start = call.method < 0 ? 0 : readOffset(i);
 
       get<0>(args) = sid;
-      tuple_for(tuple_slice<1, F::Cnt - 1>(args), [&](auto& e) { i >> e; });
+      bool decoded = readArgs(args, sid, reqID, i);
+      if (call.method >= 0)
+        server->metrics.received(call, distance(start, readOffset(i)),
+                                 !decoded);
+
+      // streams are served on the session's thread.
+      if (info->exec == Exec::Pool && !has_stream_v<decltype(args)>) {
+        auto s = server;
+        auto&& cb = [=](auto... a) {
+          s->post(sid, [=] {
+            auto o = s->getOutput(sid);
+            if (!o) {
+              s->metrics.finished(call, 0, true);
+              return;
+            }
+            auto begin = call.method < 0 ? 0 : writeOffset(*o);
+            *o << TPRC_DELIMITER(reqID);
+            (..., (*o << TPRC_DELIMITER(a)));
+            auto bytes = call.method < 0 ? 0 : distance(begin, writeOffset(*o));
+            if (info->compress)
+              markCompressible(*o);
+            s->flush(sid);
+            s->metrics.finished(call, bytes);
+          });
+        };
+        auto pin = framePin<decltype(args)>(i);
+        if (s->offload([=] {
+              (void)pin;
+              // the caller has given up already, drop the work.
+              if (deadline != Deadline{} &&
+                  std::chrono::steady_clock::now() > deadline) {
+                s->metrics.finished(call, 0, true);
+                return;
+              }
+              apply(f, tuple_cat(args, make_tuple(cb)));
+            }))
+          return;
+      }
 
       auto&& cb = [=, &o](auto... a) {
+        auto begin = call.method < 0 ? 0 : writeOffset(o);
         o << TPRC_DELIMITER(reqID);
         (..., (o << TPRC_DELIMITER(a)));
+        auto bytes = call.method < 0 ? 0 : distance(begin, writeOffset(o));
+        if (info->compress)
+          markCompressible(o);
         server->flush(sid);
+        server->metrics.finished(call, bytes);
       };
       apply(f, tuple_cat(args, make_tuple(cb)));
     };
   }
 
-  void setServer(Server* s) { server = s; }
+  // The results go out as chunks of a stream named by the request id,
+  // written on the session's thread whatever the function's Exec. The call
+  // counts as finished once the stream is over.
+  template <typename Func>
+  void addStream(string name, Func&& f) {
+    using namespace imp;
+    using Args = typename FuncTrait<decay_t<Func>>::Args;
+    constexpr auto Cnt = tuple_size_v<Args>;
+    using ArgsNoWriter =
+        typename tuple_elems<make_index_sequence<Cnt - 1>, Args>::type;
+    using Writer = tuple_element_t<Cnt - 1, Args>;
 
- protected:
-  Server* server;
+    static_assert(is_same_v<tuple_element_t<0, Args>, SessionID>,
+                  "first param should be a SessionID");
+
+    auto info = &infoOf(name);
+    funcs[name] = [=](SessionID sid, int reqID, Deadline, istream& i,
+                      ostream&) {
+      ArgsNoWriter args;
+      auto call = server->metrics.begin(info->method);
+      auto start = call.method < 0 ? 0 : readOffset(i);
+
+      get<0>(args) = sid;
+      bool decoded = readArgs(args, sid, reqID, i);
+      if (call.method >= 0)
+        server->metrics.received(call, distance(start, readOffset(i)),
+                                 !decoded);
+
+      auto w = server->openStream(sid, reqID, true);
+      auto s = server;
+      auto state = w.get();
+      w->closed = [=, closed = std::move(w->closed)](Status st) {
+        closed(st);
+        s->metrics.finished(call, state->bytes, st != Status::Ok);
+      };
+      apply(f, tuple_cat(args, make_tuple(Writer(w))));
+    };
+  }
 
- private:
   map<string, Func> funcs;
+  map<string, FuncInfo> infos;
+  Exec exec = Exec::Inline;
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+template <typename istream, typename ostream = istream>
+class BuiltinHandler : public Handler<istream, ostream> {
+ public:
+  BuiltinHandler() : Handler<istream, ostream>(BuiltinHandlerName) {
+    this->addFunction("resolve",
+                      [this](SessionID, string name, RespCb<int> cb) {
+                        cb(this->server->methodID(name));
+                      });
+    this->addFunction("subscribe", [this](SessionID sid, string topic,
+                                          bool conflate, RespCb<bool> cb) {
+      cb(this->server->subscribe(sid, topic, conflate));
+    });
+    this->addFunction("unsubscribe",
+                      [this](SessionID sid, string topic, RespCb<bool> cb) {
+                        this->server->unsubscribe(sid, topic);
+                        cb(true);
+                      });
+  }
 };
 
 //////////////////////////////////////////////////////////////////////////
@@ -194,8 +1056,30 @@ class RpcServer {
 
   SessionCb flush;
   SessionCb disconnected;
-
+  // run a task on the thread owning the session, set by threaded transports.
+  SessionTask post;
+  // Backpressure, for transports with outbound watermarks. `writable` is set
+  // by the transport when they are on and false while a session's backlog
+  // is over its high watermark, `writableChanged` is called whenever that
+  // flips, so producers can pause and resume.
+  function<bool(SessionID)> writable;
+  function<void(SessionID, bool)> writableChanged;
+  Overflow overflow = Overflow::Block;
+  // calls, errors, bytes and latencies of every handler function. Set
+  // `metrics.enabled` to false to stop recording.
+  Metrics metrics;
+  // chunks a client may send ahead on a stream a handler reads.
+  int streamWindow = 16;
+  // Set by transports able to queue one frame on many sessions, for
+  // multicast() and broadcast(): `encodeFrame` has a message written to a
+  // scratch output and returns it as a frame, `sendFrame` queues a frame
+  // on a session after what was flushed there before.
+  function<SharedFrame(const function<void(ostream&)>&)> encodeFrame;
+  function<void(SessionID, const SharedFrame&)> sendFrame;
+
+  RpcServer() { addHandlers({new BuiltinHandler<istream, ostream>}); }
   virtual ~RpcServer() {
+    workers.reset();
     for (auto i : handlers) {
       delete i.second;
     }
@@ -208,97 +1092,461 @@ class RpcServer {
     for (auto i : handlers) {
       i.second->init();
     }
+    // after init(), which may add functions too.
+    for (auto i : handlers) {
+      for (auto& f : i.second->getFunctions()) {
+        auto name = i.first + "." + f.first;
+        if (methodIDs.count(name))
+          continue;
+        methodIDs[name] = (int)methods.size();
+        methods.push_back({i.second, &f.second});
+        i.second->setMethod(f.first, metrics.addMethod(name));
+      }
+    }
+  }
+  // Worker pool for Exec::Pool handler functions, `threads` == 0 removes it
+  // after running what is still queued. When the pool is full new requests
+  // run inline, which slows down reading more of them.
+  void setWorkerPool(int threads, size_t capacity = 4096) {
+    workers.reset();
+    if (threads > 0)
+      workers = std::make_unique<WorkerPool>(threads, capacity);
   }
+
+  // run `task` on the worker pool, false if there is none, it is full or
+  // replies can't be handed back to the session's thread.
+  bool offload(function<void()> task) {
+    return workers && post && workers->submit(std::move(task));
+  }
+
+  ostream* getOutput(SessionID sid) {
+    auto s = findSession(sid);
+    return s ? s->output : nullptr;
+  }
+
+  // id of "Handler.func" in the flat dispatch table, -1 if unknown.
+  int methodID(const string& name) const {
+    auto it = methodIDs.find(name);
+    return it == methodIDs.end() ? -1 : it->second;
+  }
+
+  // Sessions are kept in `n` independent shards picked by sid % n. A
+  // multi-threaded transport gives each event loop its own shard and only
+  // touches a session from that loop, so no locking is needed. Every shard
+  // pre-allocates room for `reserve` sessions. Call before adding any session.
+  void setShards(int n, int reserve = 0) {
+    sessions.resize(n);
+    for (auto& shard : sessions) {
+      shard.sessions.reserve(reserve);
+      for (int i = 0; i < reserve; i++) {
+        shard.sessions.emplace(-1, Session());
+        shard.spare.push_back(shard.sessions.extract(-1));
+      }
+    }
+  }
+
   void addSession(SessionID sid, ostream& o) {
-    auto& s = sessions[sid];
+    auto& shard = shardOf(sid);
+    auto it = shard.sessions.find(sid);
+    if (it == shard.sessions.end()) {
+      // reuse the node of a closed session: no allocation, no rehash.
+      if (!shard.spare.empty()) {
+        auto node = std::move(shard.spare.back());
+        shard.spare.pop_back();
+        node.key() = sid;
+        node.mapped() = Session();
+        it = shard.sessions.insert(std::move(node)).position;
+      } else {
+        it = shard.sessions.emplace(sid, Session()).first;
+      }
+    }
+    auto& s = it->second;
     s.sid = sid;
     s.output = &o;
   }
 
   void removeSession(SessionID sid) {
+    vector<typename Session::Func> pending;
+    if (auto s = findSession(sid)) {
+      pending = s->requests.takeAll();
+      for (auto& i : s->topics)
+        dropSubscriber(shardOf(sid), i.first, sid);
+      s->topics.clear();
+      s->held.clear();
+      auto streams = std::move(s->streams);
+      for (auto& i : streams)
+        i.second->lost();
+    }
     for (auto i : handlers) {
       i.second->onDisconnected(sid);
     }
     if (disconnected)
       disconnected(sid);
-    sessions.erase(sid);
+    auto& shard = shardOf(sid);
+    auto node = shard.sessions.extract(sid);
+    if (node)
+      shard.spare.push_back(std::move(node));
+    // once the session is gone, so calls made from these fail too.
+    for (auto& f : pending)
+      f(Status::Cancelled, nullptr);
   }
 
+  // A frame may carry several messages when the peer batches them.
   void onReceive(SessionID sid, istream& i) {
-    if (sessions.find(sid) == sessions.end())
-      return;
+    while (hasMore(i) && dispatch(sid, i)) {
+    }
+  }
 
-    auto& session = sessions[sid];
-    auto& o = *session.output;
-    int reqID;
-    i >> reqID;
-    if (reqID == (int)RequestType::CallResponse) {
-      i >> reqID;
-      session.requests[reqID](i);
-      session.requests.erase(reqID);
-    } else {
-      i >> handler;
-      i >> func;
-      handlers[handler]->onRequest(sid, func, reqID, i, o);
+  // Stream `id` of session `sid`, named by the client's request; `writer`
+  // if the server writes it. A reader grants its window right away. For
+  // handler functions, through their Writer and Reader arguments.
+  std::shared_ptr<imp::StreamState<istream, ostream>>
+  openStream(SessionID sid, int id, bool writer) {
+    auto st = std::make_shared<imp::StreamState<istream, ostream>>();
+    st->id = id;
+    st->writer = writer;
+    auto s = findSession(sid);
+    if (!s) {
+      st->open = false;
+      return st;
     }
+    st->output = [this, sid] { return getOutput(sid); };
+    st->flush = [this, sid] { flush(sid); };
+    st->closed = [this, sid, id](Status) {
+      if (auto s = findSession(sid))
+        s->streams.erase(id);
+    };
+    s->streams[id] = st;
+    if (!writer)
+      st->grant(st->window = streamWindow);
+    return st;
   }
 
   template <typename... A>
   void notify(SessionID sid, string msg, A... a) {
-    if (sessions.find(sid) == sessions.end())
+    auto s = findSession(sid);
+    if (!s)
+      return;
+    if (overflow == Overflow::DropNotifies && writable && !writable(sid))
       return;
 
-    auto& o = *sessions[sid].output;
+    auto& o = *s->output;
     o << TPRC_DELIMITER((int)RequestType::Notify);
     o << TPRC_DELIMITER(msg);
     (..., (o << TPRC_DELIMITER(a)));
     flush(sid);
   }
 
+  // notify() every session in `sids`, or all of them. The message is
+  // encoded once when the transport shares frames, else for each session.
+  // Sessions of other shards are reached through post(), those calls
+  // return before their frames are queued.
+  template <typename... A>
+  void multicast(const vector<SessionID>& sids, string msg, A... a) {
+    fanOut(&sids, msg, a...);
+  }
+  template <typename... A>
+  void broadcast(string msg, A... a) {
+    fanOut(nullptr, msg, a...);
+  }
+
+  // Topics: values published to a topic go out as notifies named after it
+  // to every session subscribed, through "$.subscribe" or here. Leaving
+  // unsubscribes from everything. A keyed topic's values carry the key
+  // first: a session subscribed with `conflate` that isn't writable keeps
+  // only the latest value of each key and gets them once it is again, so
+  // a slow subscriber costs one value per key. Without `writable` no
+  // session ever is slow, so conflating is refused. Call from the thread
+  // of the session or, to publish, like multicast().
+  bool subscribe(SessionID sid, const string& topic, bool conflate = false) {
+    auto s = findSession(sid);
+    if (!s || (conflate && !writable))
+      return false;
+    s->topics[topic] = conflate;
+    shardOf(sid).subscribers[topic].insert(sid);
+    return true;
+  }
+  void unsubscribe(SessionID sid, const string& topic) {
+    auto s = findSession(sid);
+    if (!s || !s->topics.erase(topic))
+      return;
+    dropSubscriber(shardOf(sid), topic, sid);
+    auto prefix = topic + '\0';
+    for (auto it = s->held.begin(); it != s->held.end();) {
+      if (it->first.compare(0, prefix.size(), prefix) == 0)
+        it = s->held.erase(it);
+      else
+        ++it;
+    }
+  }
+  template <typename... A>
+  void publish(const string& topic, A... a) {
+    publishMessage(topic, nullptr, makeMessage(topic, a...));
+  }
   template <typename... A>
+  void publishKey(const string& topic, const string& key, A... a) {
+    publishMessage(topic, &key, makeMessage(topic, key, a...));
+  }
+
+  // Transports call this when a session crosses a watermark. Conflated
+  // topic values held back go out first, then writableChanged is called.
+  void sessionWritable(SessionID sid, bool w) {
+    if (w)
+      sendHeld(sid);
+    if (writableChanged)
+      writableChanged(sid, w);
+  }
+
+  template <typename... A,
+            typename = std::enable_if_t<imp::last_is_lambda_v<A...>>>
   void call(SessionID sid, string name, A... a) {
     using namespace imp;
     using Args = tuple<A...>;
     using F = ArgsTrait<Args>;
 
-    static_assert(is_lambda_v<tuple_element_t<tuple_size_v<Args> - 1, Args>>,
-                  "last param should be a lambda");
-
-    if (sessions.find(sid) == sessions.end())
-      return;
-
-    auto& session = sessions[sid];
-    auto& o = *session.output;
     auto&& args = make_tuple(a...);
     auto&& cb = get<F::Cnt - 1>(args);
+    auto onResp = [=](Status st, istream* i) {
+      typename F::CbArgs cbArgs;
+      if (readResponse(cbArgs, st, i))
+        apply(cb, cbArgs);
+    };
 
-    auto req = session.nextRequestID++;
+    auto s = findSession(sid);
+    if (!s) {
+      onResp(Status::Cancelled, nullptr);
+      return;
+    }
+    auto& session = *s;
+    auto& o = *session.output;
+    if (session.requests.full()) {
+      onResp(Status::Failed, nullptr);
+      return;
+    }
+    auto req = session.requests.add(onResp);
     o << TPRC_DELIMITER((int)RequestType::Call);
     o << TPRC_DELIMITER(name);
     o << TPRC_DELIMITER(req);
     tuple_for(tuple_slice<0, F::Cnt - 1>(args),
               [&](auto& a) { o << TPRC_DELIMITER(a); });
 
-    session.requests[req] = [=](istream& i) {
-      typename F::CbArgs cbArgs;
-      tuple_for(cbArgs, [&](auto& a) { i >> a; });
-      apply(cb, cbArgs);
-    };
-
     flush(sid);
   }
 
+#ifdef TRPC_COROUTINES
+  // Usage: auto [msg, r] = co_await call<string, int>(sid, "clientFunc", 11);
+  // These calls have no deadline, a session going away resumes them with
+  // Status::Cancelled.
+  template <typename... R,
+            typename... A,
+            typename = std::enable_if_t<!imp::last_is_lambda_v<A...>>>
+  auto call(SessionID sid, string name, A... a) {
+    return makeCallAwaiter<R...>([=](auto cb) { call(sid, name, a..., cb); });
+  }
+#endif
+
  private:
+  // a notify going to several sessions: one frame if the transport shares
+  // them, else written for each.
+  struct Message {
+    SharedFrame frame;
+    function<void(ostream&)> write;
+  };
+  using MessagePtr = std::shared_ptr<const Message>;
+
   struct Session {
-    using Func = function<void(istream& i)>;
+    using Func = SmallFunction<void(Status, istream*)>;
     SessionID sid;
     ostream* output;
-    int nextRequestID = (int)RequestType::UserRequest;
-    map<int, Func> requests;
+    RequestTable<Func> requests{(int)RequestType::UserRequest};
+    imp::Streams<istream, ostream> streams;
+    // topics subscribed to, and whether they're conflated.
+    unordered_map<string, bool> topics;
+    // conflated values waiting for the session to be writable, by topic
+    // and key.
+    unordered_map<string, MessagePtr> held;
+  };
+  struct Method {
+    Handler* handler;
+    const typename Handler::Func* func;
+  };
+
+  // handle one message, false if the rest of the frame can't be trusted.
+  bool dispatch(SessionID sid, istream& i) {
+    auto s = findSession(sid);
+    if (!s)
+      return false;
+
+    auto& session = *s;
+    auto& o = *session.output;
+    int reqID;
+    i >> reqID;
+    Deadline deadline{};
+    if (reqID == (int)RequestType::Deadline) {
+      int ms;
+      i >> ms;
+      deadline =
+          std::chrono::steady_clock::now() + std::chrono::milliseconds(ms);
+      i >> reqID;
+    }
+    if (reqID == (int)RequestType::CallResponse) {
+      i >> reqID;
+      auto cb = session.requests.take(reqID);
+      if (!cb)
+        return false;
+      cb(Status::Ok, &i);
+    } else if (imp::isStreamMessage(reqID)) {
+      return imp::dispatchStream(reqID, i, session.streams);
+    } else if (reqID == (int)RequestType::MethodCall) {
+      int id;
+      i >> id;
+      i >> reqID;
+      if (id < 0 || id >= (int)methods.size())
+        return false;
+      (*methods[id].func)(sid, reqID, deadline, i, o);
+    } else {
+      string handler, func;
+      i >> handler;
+      i >> func;
+      auto it = handlers.find(handler);
+      if (it == handlers.end())
+        return false;
+      return it->second->onRequest(sid, func, reqID, deadline, i, o);
+    }
+    return true;
+  }
+
+  using Sessions = unordered_map<SessionID, Session>;
+  struct Shard {
+    Sessions sessions;
+    vector<typename Sessions::node_type> spare;
+    // sessions of the shard subscribed to each topic.
+    unordered_map<string, unordered_set<SessionID>> subscribers;
   };
-  map<SessionID, Session> sessions;
+
+  template <typename... A>
+  MessagePtr makeMessage(const string& msg, A... a) {
+    auto m = std::make_shared<Message>();
+    m->write = [=](ostream& o) {
+      o << TPRC_DELIMITER((int)RequestType::Notify);
+      o << TPRC_DELIMITER(msg);
+      (..., (o << TPRC_DELIMITER(a)));
+    };
+    if (encodeFrame && sendFrame)
+      m->frame = encodeFrame(m->write);
+    return m;
+  }
+
+  void deliver(SessionID sid, Session& s, const Message& m) {
+    if (m.frame) {
+      sendFrame(sid, m.frame);
+    } else {
+      m.write(*s.output);
+      flush(sid);
+    }
+  }
+
+  bool dropsNotify(SessionID sid) {
+    return overflow == Overflow::DropNotifies && writable && !writable(sid);
+  }
+
+  // f(n, shards) for every shard n, on the shard's own thread, which sid n
+  // reaches.
+  void eachShard(function<void(int, int)> f) {
+    auto cnt = (int)sessions.size();
+    for (int n = 0; n < cnt; n++) {
+      if (cnt > 1 && post)
+        post(n, [=] { f(n, cnt); });
+      else
+        f(n, cnt);
+    }
+  }
+
+  template <typename... A>
+  void fanOut(const vector<SessionID>* sids, string msg, A... a) {
+    auto m = makeMessage(msg, a...);
+    auto one = [this, m](SessionID sid) {
+      auto s = findSession(sid);
+      if (s && !dropsNotify(sid))
+        deliver(sid, *s, *m);
+    };
+    if (sids) {
+      auto ids = std::make_shared<vector<SessionID>>(*sids);
+      eachShard([=](int n, int cnt) {
+        for (auto sid : *ids)
+          if (sid % cnt == n)
+            one(sid);
+      });
+    } else {
+      eachShard([=](int n, int) {
+        // listed first, sending may end sessions.
+        vector<SessionID> ids;
+        ids.reserve(sessions[n].sessions.size());
+        for (auto& i : sessions[n].sessions)
+          ids.push_back(i.first);
+        for (auto sid : ids)
+          one(sid);
+      });
+    }
+  }
+
+  void publishMessage(const string& topic,
+                      const string* key,
+                      MessagePtr m) {
+    auto held = key ? topic + '\0' + *key : string();
+    eachShard([=](int n, int) {
+      auto it = sessions[n].subscribers.find(topic);
+      if (it == sessions[n].subscribers.end())
+        return;
+      vector<SessionID> ids(it->second.begin(), it->second.end());
+      for (auto sid : ids) {
+        auto s = findSession(sid);
+        if (!s)
+          continue;
+        auto blocked = writable && !writable(sid);
+        if (blocked && !held.empty() && s->topics[topic]) {
+          s->held[held] = m;
+          continue;
+        }
+        if (!blocked || overflow != Overflow::DropNotifies)
+          deliver(sid, *s, *m);
+      }
+    });
+  }
+
+  // while the session stays writable.
+  void sendHeld(SessionID sid) {
+    Session* s;
+    while ((s = findSession(sid)) && !s->held.empty() &&
+           (!writable || writable(sid))) {
+      auto it = s->held.begin();
+      auto m = std::move(it->second);
+      s->held.erase(it);
+      deliver(sid, *s, *m);
+    }
+  }
+
+  void dropSubscriber(Shard& shard, const string& topic, SessionID sid) {
+    auto it = shard.subscribers.find(topic);
+    if (it == shard.subscribers.end())
+      return;
+    it->second.erase(sid);
+    if (it->second.empty())
+      shard.subscribers.erase(it);
+  }
+
+  Shard& shardOf(SessionID sid) { return sessions[sid % sessions.size()]; }
+  Session* findSession(SessionID sid) {
+    auto& shard = shardOf(sid);
+    auto it = shard.sessions.find(sid);
+    return it == shard.sessions.end() ? nullptr : &it->second;
+  }
+
+  vector<Shard> sessions{1};
+  unique_ptr<WorkerPool> workers;
   map<string, Handler*> handlers;
-  string func, handler;  // for debugging
+  vector<Method> methods;
+  map<string, int> methodIDs;
 };
 
 //////////////////////////////////////////////////////////////////////////
@@ -307,59 +1555,240 @@ template <typename istream, typename ostream = istream>
 class RpcClient {
  public:
   function<void()> flush;
+  // set by flush() when the transport couldn't take the frame, the call it
+  // carried then fails with Status::Failed.
+  bool unsent = false;
   function<bool(string, string, void*)> beforeResp;
+  // deadline of calls not given one, sent along so the server can drop
+  // work nobody waits for anymore. Zero for none: callbacks that don't take
+  // a Status never hear about a timeout.
+  std::chrono::milliseconds timeout{0};
+  // chunks the server may send ahead on a stream the client reads.
+  int streamWindow = 16;
 
   RpcClient(ostream& o) : output(o) {}
   virtual ~RpcClient() {}
 
   // Usage: call("Auth.Login", loginName, password, [](Result a, ...){ });
-  template <typename... A>
+  // Callbacks may take a Status first to hear about timeouts:
+  // call("Auth.Login", loginName, password, [](Status st, Result a, ...){ });
+  template <typename... A,
+            typename = std::enable_if_t<imp::last_is_lambda_v<A...>>>
   void call(string name, A... a) {
+    call(timeout, name, a...);
+  }
+
+  template <typename Rep,
+            typename Period,
+            typename... A,
+            typename = std::enable_if_t<imp::last_is_lambda_v<A...>>>
+  void call(std::chrono::duration<Rep, Period> within, string name, A... a) {
     using namespace imp;
     using Args = tuple<A...>;
     using F = ArgsTrait<Args>;
 
-    static_assert(is_lambda_v<tuple_element_t<tuple_size_v<Args> - 1, Args>>,
-                  "last param should be a lambda");
-
-    auto dot = name.find_first_of('.');
-    auto handler = name.substr(0, dot);
-    auto func = name.substr(dot + 1);
-    auto req = nextRequestID++;
-    output << TPRC_DELIMITER(req);
-    output << TPRC_DELIMITER(handler);
-    output << TPRC_DELIMITER(func);
-
     auto args = make_tuple(a...);
     auto cb = get<F::Cnt - 1>(args);
-    requests[req] = [=](istream& i) {
+
+    const Method* method = nullptr;
+    string handler, func;
+    auto m = methods.find(name);
+    if (m != methods.end()) {
+      method = &m->second;
+    } else {
+      auto dot = name.find_first_of('.');
+      handler = name.substr(0, dot);
+      func = name.substr(dot + 1);
+    }
+
+    // the time left goes out as an int of ms, ~24.8 days at most.
+    using std::chrono::milliseconds;
+    auto ms = std::min(std::chrono::duration_cast<milliseconds>(within),
+                       milliseconds(INT_MAX));
+    Deadline deadline{};
+    if (ms.count() > 0)
+      deadline = std::chrono::steady_clock::now() + ms;
+
+    auto onResp = [=](Status st, istream* i) {
       typename F::CbArgs cbArgs;
-      tuple_for(cbArgs, [&](auto& a) { i >> a; });
+      if (!readResponse(cbArgs, st, i))
+        return;
       bool callUser = true;
-      if (beforeResp)
-        callUser = beforeResp(handler, func, &get<0>(cbArgs));
+      if (beforeResp && st == Status::Ok) {
+        callUser = method ? beforeResp(method->handler, method->func,
+                                       firstResult(cbArgs))
+                          : beforeResp(handler, func, firstResult(cbArgs));
+      }
       if (callUser)
         apply(cb, cbArgs);
     };
+    // every request id is in use.
+    if (requests.full()) {
+      onResp(Status::Failed, nullptr);
+      return;
+    }
+    auto req = requests.add(onResp, deadline);
+    if (ms.count() > 0) {
+      output << TPRC_DELIMITER((int)RequestType::Deadline);
+      output << TPRC_DELIMITER((int)ms.count());
+    }
+    if (method) {
+      output << TPRC_DELIMITER((int)RequestType::MethodCall);
+      output << TPRC_DELIMITER(method->id);
+      output << TPRC_DELIMITER(req);
+    } else {
+      output << TPRC_DELIMITER(req);
+      output << TPRC_DELIMITER(handler);
+      output << TPRC_DELIMITER(func);
+    }
     tuple_for(tuple_slice<0, F::Cnt - 1>(args),
               [&](auto& a) { output << TPRC_DELIMITER(a); });
-    flush();
+    flushRequest(req);
+  }
+
+#ifdef TRPC_COROUTINES
+  // Usage: int r = co_await call<int>("Calc.add", 1, 2);
+  // Several results come back as a tuple, none as void. The coroutine is
+  // resumed from onReceive. A failed call throws RpcError, unless the
+  // results start with a Status.
+  template <typename... R,
+            typename... A,
+            typename = std::enable_if_t<!imp::last_is_lambda_v<A...>>>
+  auto call(string name, A... a) {
+    return call<R...>(timeout, name, a...);
+  }
+
+  template <typename... R,
+            typename Rep,
+            typename Period,
+            typename... A,
+            typename = std::enable_if_t<!imp::last_is_lambda_v<A...>>>
+  auto call(std::chrono::duration<Rep, Period> within, string name, A... a) {
+    return makeCallAwaiter<R...>(
+        [=](auto cb) { call(within, name, a..., cb); });
+  }
+#endif
+
+  // Ask the server for the method id of "Handler.func" once; later calls to
+  // the same name carry only that id instead of the handler/function strings.
+  // Names the server doesn't know keep being called by name.
+  void resolve(string name, function<void(bool)> cb = nullptr) {
+    call(string(BuiltinHandlerName) + ".resolve", name, [=](Status st, int id) {
+      auto ok = st == Status::Ok && id >= 0;
+      if (ok) {
+        auto dot = name.find_first_of('.');
+        methods[name] = {id, name.substr(0, dot), name.substr(dot + 1)};
+      }
+      if (cb)
+        cb(ok);
+    });
+  }
+
+  // Server streaming, to a handler function taking a Writer. Usage:
+  // auto r = stream("Db.rows", query, [](Row row) { ... },
+  //                 [](Status st, const string& error) { ... });
+  // The chunk callback is called with every chunk and the end callback
+  // once, see StreamReader. r.cancel() gives up on the stream. Streams
+  // have no deadline.
+  template <typename... A>
+  auto stream(string name, A... a) {
+    using namespace imp;
+    using Args = tuple<A...>;
+    constexpr auto Cnt = sizeof...(A);
+    static_assert(Cnt >= 2 && is_lambda_v<tuple_element_t<Cnt - 2, Args>> &&
+                      is_lambda_v<tuple_element_t<Cnt - 1, Args>>,
+                  "last two params should be lambdas");
+    using Chunk = typename FuncTrait<tuple_element_t<Cnt - 2, Args>>::Args;
+    using Reader = typename ReaderOf<istream, ostream, Chunk>::type;
+
+    auto args = make_tuple(a...);
+    if (requests.full()) {
+      get<Cnt - 1>(args)(Status::Failed, string("too many requests"));
+      return Reader();
+    }
+    // the id is a request's, so it differs from those of uploads.
+    auto id = requests.add(nullptr);
+    auto st = openStream(id, false);
+    st->closed = [this, id](Status) {
+      streams.erase(id);
+      requests.take(id);
+    };
+    Reader r(st);
+    r.onChunk(get<Cnt - 2>(args));
+    r.onEnd(get<Cnt - 1>(args));
+
+    writeCall(id, name);
+    tuple_for(tuple_slice<0, Cnt - 2>(args),
+              [&](auto& a) { output << TPRC_DELIMITER(a); });
+    unsent = false;
+    st->grant(st->window = streamWindow);
+    if (std::exchange(unsent, false))
+      st->end(Status::Failed, "not sent");
+    return r;
   }
 
+  // Client streaming, to a handler function taking a Reader. Usage:
+  // auto w = upload<Row>("Db.insert", table, [](int inserted) { ... });
+  // then write chunks while w.ready() and end() it, see StreamWriter. The
+  // response callback is as for call(), the stream closes if the response
+  // comes first.
+  template <typename... T,
+            typename... A,
+            typename = std::enable_if_t<imp::last_is_lambda_v<A...>>>
+  StreamWriter<istream, ostream, T...> upload(string name, A... a) {
+    using namespace imp;
+    using Args = tuple<A...>;
+    using F = ArgsTrait<Args>;
+
+    auto args = make_tuple(a...);
+    auto cb = get<F::Cnt - 1>(args);
+    auto st = std::make_shared<Stream>();
+    auto onResp = [=](Status s, istream* i) {
+      // the server won't read more.
+      st->end(Status::Cancelled);
+      typename F::CbArgs cbArgs;
+      if (readResponse(cbArgs, s, i))
+        apply(cb, cbArgs);
+    };
+    if (requests.full()) {
+      onResp(Status::Failed, nullptr);
+      return {};
+    }
+    auto req = requests.add(onResp);
+    openStream(req, true, st);
+
+    writeCall(req, name);
+    tuple_for(tuple_slice<0, F::Cnt - 1>(args),
+              [&](auto& a) { output << TPRC_DELIMITER(a); });
+    flushRequest(req);
+    return StreamWriter<istream, ostream, T...>(st);
+  }
+
+  // A frame may carry several messages when the peer batches them.
   void onReceive(istream& i) {
-    int requestID;
-    i >> requestID;
-    if (requestID == (int)RequestType::Notify) {
-      i >> handlerName;
-      notifyHandlers[handlerName](i);
-    } else if (requestID == (int)RequestType::Call) {
-      int req;
-      i >> handlerName;
-      i >> req;
-      callHandlers[handlerName](req, i);
-    } else {
-      requests[requestID](i);
-      requests.erase(requestID);
+    while (hasMore(i) && dispatch(i)) {
+    }
+  }
+
+  // Fail calls whose deadline has passed with Status::Timeout. Transports
+  // call this every TimerTick or so while hasDeadlines().
+  void expire(Deadline now = std::chrono::steady_clock::now()) {
+    requests.expire(now, [](Func& cb) { cb(Status::Timeout, nullptr); });
+  }
+  bool hasDeadlines() const { return requests.timedSize() > 0; }
+
+  // The connection is gone: open streams end and pending calls complete
+  // with Status::Cancelled. Transports call this when they lose it.
+  void connectionLost() {
+    auto pending = requests.takeAll();
+    auto open = std::move(streams);
+    streams.clear();
+    for (auto& i : open)
+      i.second->lost();
+    for (auto& f : pending) {
+      // streams a client reads hold an id without a callback.
+      if (f)
+        f(Status::Cancelled, nullptr);
     }
   }
 
@@ -373,6 +1802,29 @@ class RpcClient {
     };
   }
 
+  // Usage: subscribe("prices", [](string symbol, double price) { ... });
+  // Values published to the topic arrive like notifies named after it,
+  // those of a keyed topic with the key first. See RpcServer::subscribe()
+  // for `conflate`, `done` tells whether the server took the subscription.
+  template <typename Func>
+  void subscribe(string topic,
+                 Func&& f,
+                 bool conflate = false,
+                 function<void(bool)> done = nullptr) {
+    onNotify(topic, std::forward<Func>(f));
+    call(string(BuiltinHandlerName) + ".subscribe", topic, conflate,
+         [=](bool ok) {
+           if (!ok)
+             notifyHandlers.erase(topic);
+           if (done)
+             done(ok);
+         });
+  }
+  void unsubscribe(string topic) {
+    notifyHandlers.erase(topic);
+    call(string(BuiltinHandlerName) + ".unsubscribe", topic, [](bool) {});
+  }
+
   template <typename Func>
   void onCall(string name, Func&& f) {
     callHandlers[name] = [=](int reqID, istream& input) {
@@ -396,12 +1848,85 @@ class RpcClient {
   }
 
  private:
-  using Func = function<void(istream& i)>;
+  using Func = SmallFunction<void(Status, istream*)>;
+  using Stream = imp::StreamState<istream, ostream>;
+  struct Method {
+    int id;
+    string handler, func;
+  };
+
+  // handle one message, false if the rest of the frame can't be trusted.
+  bool dispatch(istream& i) {
+    int requestID;
+    i >> requestID;
+    if (requestID == (int)RequestType::Notify) {
+      i >> handlerName;
+      auto it = notifyHandlers.find(handlerName);
+      if (it == notifyHandlers.end())
+        return false;
+      it->second(i);
+    } else if (requestID == (int)RequestType::Call) {
+      int req;
+      i >> handlerName;
+      i >> req;
+      auto it = callHandlers.find(handlerName);
+      if (it == callHandlers.end())
+        return false;
+      it->second(req, i);
+    } else if (imp::isStreamMessage(requestID)) {
+      return imp::dispatchStream(requestID, i, streams);
+    } else {
+      auto cb = requests.take(requestID);
+      if (!cb)
+        return false;
+      cb(Status::Ok, &i);
+    }
+    return true;
+  }
+
+  // flush the frame carrying request `req`, failing it if it wasn't sent.
+  void flushRequest(int req) {
+    unsent = false;
+    flush();
+    if (!std::exchange(unsent, false))
+      return;
+    if (auto cb = requests.take(req))
+      cb(Status::Failed, nullptr);
+  }
+
+  // the header of request `req` to `name`, by method id once resolved.
+  void writeCall(int req, const string& name) {
+    auto m = methods.find(name);
+    if (m != methods.end()) {
+      output << TPRC_DELIMITER((int)RequestType::MethodCall);
+      output << TPRC_DELIMITER(m->second.id);
+      output << TPRC_DELIMITER(req);
+    } else {
+      auto dot = name.find_first_of('.');
+      output << TPRC_DELIMITER(req);
+      output << TPRC_DELIMITER(name.substr(0, dot));
+      output << TPRC_DELIMITER(name.substr(dot + 1));
+    }
+  }
+
+  std::shared_ptr<Stream> openStream(
+      int id,
+      bool writer,
+      std::shared_ptr<Stream> st = std::make_shared<Stream>()) {
+    st->id = id;
+    st->writer = writer;
+    st->output = [this] { return &output; };
+    st->flush = [this] { flush(); };
+    st->closed = [this, id](Status) { streams.erase(id); };
+    streams[id] = st;
+    return st;
+  }
 
-  map<int, Func> requests;
+  RequestTable<Func> requests{(int)RequestType::UserRequest};
+  imp::Streams<istream, ostream> streams;
+  unordered_map<string, Method> methods;
   map<string, function<void(istream&)>> notifyHandlers;
   map<string, function<void(int, istream&)>> callHandlers;
-  int nextRequestID = (int)RequestType::UserRequest;
   ostream& output;
   string handlerName;
 };
@@ -419,11 +1944,14 @@ class RpcHandler : public Handler<istream, ostream> {
 
   struct Reg {
     template <typename U>
-    Reg(Handler<istream, ostream>* h, string n, U u) {
+    Reg(Handler<istream, ostream>* h, string n, U u, Exec e = Exec::Inline) {
       h->addFunction(n, u);
+      if (e != Exec::Inline)
+        h->setExec(n, e);
     }
   };
 };
 
 #define TRPC(name) Reg __##name{this, #name, &Sub::name};
+#define TRPC_POOLED(name) Reg __##name{this, #name, &Sub::name, Exec::Pool};
 }  // namespace trpc
@@ -0,0 +1,268 @@
+//////////////////////////////////////////////////////////////////////////
+// Per-method server metrics
+//
+// by soniced@sina.com.
+// All rights reserved.
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "histogram.h"
+
+namespace trpc {
+
+// Totals of one "Handler.func" since the server started.
+struct MethodStats {
+  std::string name;
+  uint64_t calls = 0;
+  // requests that failed to decode, were dropped past their deadline or
+  // whose reply found the session gone.
+  uint64_t errors = 0;
+  uint64_t inFlight = 0;
+  uint64_t requestBytes = 0;
+  uint64_t responseBytes = 0;
+  // nanoseconds from decoding the request to flushing its reply.
+  Histogram latency;
+};
+
+// Counters are kept per thread and only merged by snapshot(), so threads
+// serving requests don't contend with each other. A request may finish on
+// another thread than the one it started on, the in-flight gauge is the
+// difference of the merged totals.
+// Memory: each thread's shard holds a latency Histogram of ~18 KB for every
+// method up to the highest one it served, so a server with 100 methods and
+// 16 threads serving them all can hold ~28 MB. Clear `enabled` to avoid it.
+class Metrics {
+ public:
+  using Clock = std::chrono::steady_clock;
+
+  // one request being served, carried along to its reply.
+  struct Call {
+    int method = -1;
+    Clock::time_point start;
+  };
+
+  bool enabled = true;
+
+  Metrics() : id(nextID()) {}
+  Metrics(const Metrics&) = delete;
+
+  // register a method, returns its index.
+  int addMethod(std::string name) {
+    std::lock_guard<std::mutex> l(registry);
+    names.push_back(std::move(name));
+    return (int)names.size() - 1;
+  }
+
+  Call begin(int method) const {
+    if (!enabled || method < 0)
+      return {};
+    return {method, Clock::now()};
+  }
+
+  // the request of `c` took `bytes` to decode.
+  void received(const Call& c, size_t bytes, bool failed) {
+    if (c.method < 0)
+      return;
+    auto& s = local();
+    std::lock_guard<std::mutex> l(s.lock);
+    auto& m = s.at(c.method);
+    m.calls++;
+    m.started++;
+    m.requestBytes += bytes;
+    if (failed)
+      m.errors++;
+  }
+
+  // the reply of `c` took `bytes`, or there won't be one if `failed`.
+  void finished(const Call& c, size_t bytes, bool failed = false) {
+    if (c.method < 0)
+      return;
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                  Clock::now() - c.start)
+                  .count();
+    auto& s = local();
+    std::lock_guard<std::mutex> l(s.lock);
+    auto& m = s.at(c.method);
+    m.finished++;
+    m.responseBytes += bytes;
+    if (failed)
+      m.errors++;
+    else
+      m.latency.record((uint64_t)ns);
+  }
+
+  // totals of every method, merged from all threads.
+  std::vector<MethodStats> snapshot() const {
+    std::lock_guard<std::mutex> l(registry);
+    std::vector<MethodStats> r(names.size());
+    std::vector<uint64_t> started(names.size()), finished(names.size());
+    for (size_t i = 0; i < names.size(); i++)
+      r[i].name = names[i];
+    for (auto& s : shards) {
+      std::lock_guard<std::mutex> sl(s->lock);
+      for (size_t i = 0; i < s->methods.size() && i < r.size(); i++) {
+        auto& m = s->methods[i];
+        r[i].calls += m.calls;
+        r[i].errors += m.errors;
+        r[i].requestBytes += m.requestBytes;
+        r[i].responseBytes += m.responseBytes;
+        r[i].latency.merge(m.latency);
+        started[i] += m.started;
+        finished[i] += m.finished;
+      }
+    }
+    for (size_t i = 0; i < r.size(); i++)
+      r[i].inFlight = started[i] > finished[i] ? started[i] - finished[i] : 0;
+    return r;
+  }
+
+ private:
+  struct Counts {
+    uint64_t calls = 0, errors = 0, started = 0, finished = 0;
+    uint64_t requestBytes = 0, responseBytes = 0;
+    Histogram latency;
+  };
+  struct Shard {
+    // only contended while a snapshot is taken.
+    std::mutex lock;
+    std::vector<Counts> methods;
+    Counts& at(int i) {
+      if ((size_t)i >= methods.size())
+        methods.resize(i + 1);
+      return methods[i];
+    }
+  };
+
+  static uint64_t nextID() {
+    static std::atomic<uint64_t> n{0};
+    return ++n;
+  }
+
+  // this thread's shard, created on first use. Ids are never reused, so an
+  // entry left over from a destroyed instance is never matched.
+  Shard& local() {
+    thread_local std::vector<std::pair<uint64_t, Shard*>> cache;
+    for (auto& i : cache)
+      if (i.first == id)
+        return *i.second;
+    std::lock_guard<std::mutex> l(registry);
+    shards.push_back(std::make_unique<Shard>());
+    cache.push_back({id, shards.back().get()});
+    return *shards.back();
+  }
+
+  uint64_t id;
+  mutable std::mutex registry;
+  std::vector<std::string> names;
+  std::vector<std::unique_ptr<Shard>> shards;
+};
+
+//////////////////////////////////////////////////////////////////////////
+// Prometheus text exposition
+
+namespace imp {
+inline std::string promLabel(const std::string& s) {
+  std::string r;
+  for (auto c : s) {
+    if (c == '\\' || c == '"')
+      r += '\\';
+    if (c == '\n')
+      r += "\\n";
+    else
+      r += c;
+  }
+  return r;
+}
+}  // namespace imp
+
+inline std::string toPrometheus(const std::vector<MethodStats>& stats,
+                                const std::string& prefix = "trpc") {
+  std::string out;
+  char buf[512];
+  auto counter = [&](const char* name, const char* type, const char* help,
+                     uint64_t MethodStats::*field) {
+    out += "# HELP " + prefix + "_" + name + " " + help + "\n";
+    out += "# TYPE " + prefix + "_" + name + " " + type + "\n";
+    for (auto& m : stats) {
+      snprintf(buf, sizeof(buf), "%s_%s{method=\"%s\"} %llu\n",
+               prefix.c_str(), name, imp::promLabel(m.name).c_str(),
+               (unsigned long long)(m.*field));
+      out += buf;
+    }
+  };
+  counter("calls_total", "counter", "Requests received.", &MethodStats::calls);
+  counter("errors_total", "counter",
+          "Requests undecodable, dropped past their deadline or unanswerable.",
+          &MethodStats::errors);
+  counter("in_flight", "gauge", "Requests not replied to yet.",
+          &MethodStats::inFlight);
+  counter("request_bytes_total", "counter", "Bytes of request arguments.",
+          &MethodStats::requestBytes);
+  counter("response_bytes_total", "counter", "Bytes of replies.",
+          &MethodStats::responseBytes);
+
+  static const double bounds[] = {1e-5, 5e-5, 1e-4, 5e-4, 1e-3, 5e-3,
+                                  1e-2, 5e-2, 0.1,  0.5,  1,    5};
+  auto name = prefix + "_latency_seconds";
+  out += "# HELP " + name +
+         " Time from decoding a request to flushing its reply.\n";
+  out += "# TYPE " + name + " histogram\n";
+  for (auto& m : stats) {
+    auto label = imp::promLabel(m.name);
+    for (auto b : bounds) {
+      // le is an upper bound: buckets straddling it aren't counted.
+      auto le = (uint64_t)(b * 1e9 + 0.5);
+      snprintf(buf, sizeof(buf), "%s_bucket{method=\"%s\",le=\"%g\"} %llu\n",
+               name.c_str(), label.c_str(), b,
+               (unsigned long long)m.latency.countUpTo(le));
+      out += buf;
+    }
+    auto n = (unsigned long long)m.latency.count();
+    snprintf(buf, sizeof(buf),
+             "%s_bucket{method=\"%s\",le=\"+Inf\"} %llu\n"
+             "%s_sum{method=\"%s\"} %.9f\n"
+             "%s_count{method=\"%s\"} %llu\n",
+             name.c_str(), label.c_str(), n, name.c_str(), label.c_str(),
+             m.latency.mean() * n / 1e9, name.c_str(), label.c_str(), n);
+    out += buf;
+  }
+  return out;
+}
+
+inline void exportPrometheus(const Metrics& m,
+                             const std::function<void(const std::string&)>& cb,
+                             const std::string& prefix = "trpc") {
+  cb(toPrometheus(m.snapshot(), prefix));
+}
+
+// Written next to `path` first and renamed over it, so a scraper reading
+// the file never sees half of it.
+inline bool exportPrometheus(const Metrics& m,
+                             const std::string& path,
+                             const std::string& prefix = "trpc") {
+  auto text = toPrometheus(m.snapshot(), prefix);
+  auto tmp = path + ".tmp";
+  auto f = fopen(tmp.c_str(), "wb");
+  if (!f)
+    return false;
+  auto ok = fwrite(text.data(), 1, text.size(), f) == text.size();
+  ok = fclose(f) == 0 && ok;
+#ifdef _WIN32
+  // rename() doesn't replace an existing file there.
+  if (ok)
+    remove(path.c_str());
+#endif
+  return ok && rename(tmp.c_str(), path.c_str()) == 0;
+}
+
+}  // namespace trpc
@@ -0,0 +1,1028 @@
+//////////////////////////////////////////////////////////////////////////
+// io_uring transport for Linux
+//
+// by soniced@sina.com.
+// All rights reserved.
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include "asioTRpc.h"
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define TRPC_URING 1
+
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <cerrno>
+
+namespace trpc {
+
+// Speaks the frames of the asio transport, so either end can be asio.
+//
+// Every connection keeps one multishot receive armed, filled from a ring of
+// buffers provided to the kernel and shared by all connections. Replies
+// produced while handling one sweep of completions are gathered per
+// connection, written to its slice of a registered buffer and submitted
+// together with a single io_uring_enter. Under load one syscall carries many
+// messages, polling with nothing to do makes none.
+
+namespace imp {
+
+// The kernel interface without liburing: submission and completion queues
+// mapped from the ring's fd and shared through their head and tail indexes.
+class Uring {
+ public:
+  Uring() {}
+  Uring(const Uring&) = delete;
+  ~Uring() { close(); }
+
+  bool open(unsigned entries, unsigned sqPollIdleMs) {
+    io_uring_params p{};
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = entries * 4;
+    if (sqPollIdleMs) {
+      p.flags |= IORING_SETUP_SQPOLL;
+      p.sq_thread_idle = sqPollIdleMs;
+    } else {
+      // completions are posted when we enter the kernel anyway, the flag
+      // tells when to enter just for them.
+      p.flags |= IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG;
+    }
+    fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (fd < 0 && !sqPollIdleMs) {
+      p.flags &= ~(IORING_SETUP_COOP_TASKRUN | IORING_SETUP_TASKRUN_FLAG);
+      fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    }
+    if (fd < 0)
+      return false;
+    sqPoll = sqPollIdleMs != 0;
+
+    sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    cqSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+    auto single = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single)
+      sqSize = cqSize = std::max(sqSize, cqSize);
+    sqRing = map(sqSize, IORING_OFF_SQ_RING);
+    cqRing = single ? sqRing : map(cqSize, IORING_OFF_CQ_RING);
+    sqesSize = p.sq_entries * sizeof(io_uring_sqe);
+    sqes = (io_uring_sqe*)map(sqesSize, IORING_OFF_SQES);
+    if (!sqRing || !cqRing || !sqes) {
+      close();
+      return false;
+    }
+
+    sqHead = (unsigned*)(sqRing + p.sq_off.head);
+    sqTail = (unsigned*)(sqRing + p.sq_off.tail);
+    sqFlags = (unsigned*)(sqRing + p.sq_off.flags);
+    sqMask = *(unsigned*)(sqRing + p.sq_off.ring_mask);
+    sqEntries = p.sq_entries;
+    auto array = (unsigned*)(sqRing + p.sq_off.array);
+    for (unsigned i = 0; i < sqEntries; i++)
+      array[i] = i;
+    cqHead = (unsigned*)(cqRing + p.cq_off.head);
+    cqTail = (unsigned*)(cqRing + p.cq_off.tail);
+    cqMask = *(unsigned*)(cqRing + p.cq_off.ring_mask);
+    cqes = (io_uring_cqe*)(cqRing + p.cq_off.cqes);
+    localTail = *sqTail;
+    return true;
+  }
+
+  void close() {
+    if (sqes)
+      munmap(sqes, sqesSize);
+    if (cqRing && cqRing != sqRing)
+      munmap(cqRing, cqSize);
+    if (sqRing)
+      munmap(sqRing, sqSize);
+    sqes = nullptr;
+    sqRing = cqRing = nullptr;
+    if (fd >= 0)
+      ::close(fd);
+    fd = -1;
+  }
+
+  // a zeroed entry to fill, submitting the queued ones first if it is full.
+  // Null if that made no room, as a polling kernel thread drains the queue
+  // at its own pace.
+  io_uring_sqe* get() {
+    if (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) {
+      submit();
+      if (localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries)
+        return nullptr;
+    }
+    auto e = &sqes[localTail++ & sqMask];
+    memset(e, 0, sizeof(*e));
+    return e;
+  }
+
+  // hand the queued entries to the kernel, entering it only when there are
+  // some, completions wait to be posted or `wait` asks to block for one.
+  void submit(bool wait = false, std::chrono::nanoseconds timeout = {}) {
+    auto n = localTail - submitted;
+    __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+    submitted = localTail;
+    auto sqf = __atomic_load_n(sqFlags, __ATOMIC_RELAXED);
+    unsigned flags = 0;
+    if (wait || (sqf & (IORING_SQ_TASKRUN | IORING_SQ_CQ_OVERFLOW)))
+      flags |= IORING_ENTER_GETEVENTS;
+    if (sqPoll) {
+      // the kernel thread picks entries up by itself while awake.
+      if (n && (sqf & IORING_SQ_NEED_WAKEUP))
+        flags |= IORING_ENTER_SQ_WAKEUP;
+      n = 0;
+    }
+    if (!n && !flags)
+      return;
+    stats.enters++;
+    if (!wait) {
+      syscall(__NR_io_uring_enter, fd, n, 0, flags, nullptr, 0);
+      return;
+    }
+    __kernel_timespec ts{(long long)(timeout.count() / 1000000000),
+                         (long long)(timeout.count() % 1000000000)};
+    io_uring_getevents_arg arg{};
+    arg.sigmask_sz = _NSIG / 8;
+    arg.ts = (uint64_t)&ts;
+    syscall(__NR_io_uring_enter, fd, n, 1, flags | IORING_ENTER_EXT_ARG, &arg,
+            sizeof(arg));
+  }
+
+  // call `f` for every posted completion, returns how many.
+  template <typename F>
+  unsigned reap(F f) {
+    unsigned n = 0;
+    for (;;) {
+      auto head = *cqHead;
+      auto tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+      if (head == tail)
+        return n;
+      for (; head != tail; head++, n++)
+        f(cqes[head & cqMask]);
+      __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    }
+  }
+
+  int registerOp(unsigned op, void* arg, unsigned n) {
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, n);
+  }
+
+  struct Stats {
+    size_t enters = 0;
+  };
+  Stats stats;
+
+ private:
+  char* map(size_t size, off_t offset) {
+    auto p = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, fd, offset);
+    return p == MAP_FAILED ? nullptr : (char*)p;
+  }
+
+  int fd = -1;
+  bool sqPoll = false;
+  char* sqRing = nullptr;
+  char* cqRing = nullptr;
+  io_uring_sqe* sqes = nullptr;
+  size_t sqSize = 0, cqSize = 0, sqesSize = 0;
+  unsigned *sqHead, *sqTail, *sqFlags, *cqHead, *cqTail;
+  unsigned sqMask = 0, sqEntries = 0, cqMask = 0;
+  io_uring_cqe* cqes = nullptr;
+  unsigned localTail = 0, submitted = 0;
+};
+
+// small frames like stream credit must not wait behind a delayed ack.
+inline int noDelay(int fd) {
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  return fd;
+}
+
+}  // namespace imp
+
+//////////////////////////////////////////////////////////////////////////
+
+class UringTransport;
+
+// One connection. Frames sent during a sweep are gathered and written
+// together when it ends, into the connection's half of a registered buffer
+// while they fit and into heap storage after that.
+class UringPeer {
+ public:
+  struct Stats {
+    size_t frames = 0;
+    size_t writes = 0;
+    size_t bytes = 0;
+  };
+  Stats stats;
+
+  virtual ~UringPeer() {}
+  virtual void onError(const error_code& err) {
+    printf("error: %s\n", err.message().c_str());
+  }
+  // the last operation of a closing peer completed.
+  virtual void onIdle() {}
+
+  // queue the bytes written to `body` as one frame.
+  void send(MemOStream& body) {
+    if (fd < 0 || closing)
+      return;
+    uint64_t flags = body.getCodec() == Codec::Compact
+                         ? FrameReader::FrameCompact
+                         : 0;
+    auto head = imp::littleEndian(body.getSize() | flags);
+    append((const char*)&head, sizeof(head));
+    append(body.data(), body.getSize());
+    body.reset();
+    stats.frames++;
+    markDirty();
+  }
+
+  // queue a frame encoded once for many peers, see AsioPeer::shareFrame().
+  // It is copied into the send slot like any other.
+  void sendShared(const SharedFrame& frame) {
+    if (fd < 0 || closing)
+      return;
+    append(frame->data(), frame->size());
+    stats.frames++;
+    markDirty();
+  }
+
+  void receive(const Action<MemIStream&>& onReceived) { receiver = onReceived; }
+  // frames received larger than `n` bytes are an error.
+  void setMaxFrame(size_t n) { frames.maxFrame = n; }
+
+  // no operation is in flight.
+  bool idle() const { return !ops; }
+
+ protected:
+  friend class UringTransport;
+
+  void append(const char* p, size_t n) {
+    if (spill.empty() && !held[fill] && used[fill] + n <= cap) {
+      memcpy(out[fill] + used[fill], p, n);
+      used[fill] += n;
+    } else {
+      spill.append(p, n);
+    }
+  }
+
+  void markDirty();
+
+  void resetPeer() {
+    frames.reset();
+    used[0] = used[1] = 0;
+    held[0] = held[1] = 0;
+    fill = 0;
+    spill.clear();
+    spilling.clear();
+    sending = closing = dirty = false;
+    sendLeft = 0;
+  }
+
+  UringTransport* io = nullptr;
+  int fd = -1;
+  // operations in flight.
+  int ops = 0;
+  bool closing = false;
+  bool dirty = false;
+  FrameReader frames;
+  Action<MemIStream&> receiver;
+
+  // the two halves of the registered slot, filled in turns. A half is
+  // `held` until the kernel is done with the sends made from it.
+  int slot = -1;
+  char* out[2] = {};
+  size_t cap = 0;
+  size_t used[2] = {};
+  int held[2] = {};
+  int fill = 0;
+  // frames that didn't fit, and those of them being written.
+  string spill, spilling;
+  bool sending = false;
+  int sendIndex = -1;
+  const char* sendPtr = nullptr;
+  size_t sendLeft = 0;
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+// The ring, the buffers shared by its connections and the sweep that drives
+// them, owned by a server or client.
+class UringTransport {
+ public:
+  struct Options {
+    unsigned entries = 1024;
+    // provided receive buffers, shared by all connections.
+    unsigned buffers = 512;
+    size_t bufferBytes = 16 * 1024;
+    // connections that get a registered send slot, and its size. The slot
+    // is sent from without copying, the memory is pinned, so it counts
+    // against RLIMIT_MEMLOCK. Without a slot connections write from the
+    // heap.
+    int fixedSlots = 64;
+    size_t slotBytes = 64 * 1024;
+    // nonzero: a kernel thread polls the submission queue and stops after
+    // that many idle milliseconds, submitting needs no syscall.
+    unsigned sqPollIdleMs = 0;
+  };
+  struct Stats {
+    size_t completions = 0;
+    size_t fixedWrites = 0;
+    size_t writes = 0;
+  };
+
+  Stats stats;
+  Action<int> accepted;
+  Action<int> connected;
+
+  UringTransport() {}
+  UringTransport(const UringTransport&) = delete;
+  ~UringTransport() { close(); }
+
+  bool open(const Options& o) {
+    opts = o;
+    if (!ring.open(o.entries, o.sqPollIdleMs))
+      return false;
+
+    // the buffer ring's entries must be a power of two.
+    unsigned n = 1;
+    while (n < o.buffers && n < 32768)
+      n *= 2;
+    bufCount = n;
+    bufRingSize = (n * sizeof(io_uring_buf) + 4095) & ~(size_t)4095;
+    auto p = mmap(nullptr, bufRingSize, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+      close();
+      return false;
+    }
+    bufRing = (io_uring_buf_ring*)p;
+    bufData.resize(n * o.bufferBytes);
+    io_uring_buf_reg reg{};
+    reg.ring_addr = (uint64_t)bufRing;
+    reg.ring_entries = n;
+    reg.bgid = BufGroup;
+    if (ring.registerOp(IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+      close();
+      return false;
+    }
+    for (unsigned i = 0; i < n; i++)
+      giveBack((uint16_t)i);
+    commitBuffers();
+
+    if (o.fixedSlots > 0) {
+      arena.resize(o.fixedSlots * 2 * o.slotBytes);
+      iovec iov{arena.data(), arena.size()};
+      if (ring.registerOp(IORING_REGISTER_BUFFERS, &iov, 1) == 0) {
+        for (int i = o.fixedSlots - 1; i >= 0; i--)
+          freeSlots.push_back(i);
+      } else {
+        arena.clear();
+        arena.shrink_to_fit();
+      }
+    }
+    return true;
+  }
+
+  void close() {
+    ring.close();
+    if (bufRing)
+      munmap(bufRing, bufRingSize);
+    bufRing = nullptr;
+  }
+
+  size_t enters() const { return ring.stats.enters; }
+
+  // start serving `p` on the connected socket `fd`.
+  void attach(UringPeer* p, int fd) {
+    p->io = this;
+    p->fd = fd;
+    p->resetPeer();
+    if (!freeSlots.empty()) {
+      p->slot = freeSlots.back();
+      freeSlots.pop_back();
+      auto base = arena.data() + p->slot * 2 * opts.slotBytes;
+      p->out[0] = base;
+      p->out[1] = base + opts.slotBytes;
+      p->cap = opts.slotBytes;
+    }
+    armRecv(p);
+  }
+
+  // stop reading and writing, what is in flight completes with an error.
+  void shutdown(UringPeer* p) {
+    if (p->fd < 0 || p->closing)
+      return;
+    p->closing = true;
+    ::shutdown(p->fd, SHUT_RDWR);
+  }
+
+  // close the socket once nothing is in flight anymore, true if it is.
+  bool release(UringPeer* p) {
+    if (!p->idle())
+      return false;
+    if (p->fd >= 0)
+      ::close(p->fd);
+    p->fd = -1;
+    if (p->slot >= 0)
+      freeSlots.push_back(p->slot);
+    p->slot = -1;
+    p->out[0] = p->out[1] = nullptr;
+    p->cap = 0;
+    // the peer may serve another connection before this sweep ends.
+    dirty.erase(std::remove(dirty.begin(), dirty.end(), p), dirty.end());
+    rearm.erase(std::remove(rearm.begin(), rearm.end(), p), rearm.end());
+    p->dirty = false;
+    return true;
+  }
+
+  void listen(int fd) {
+    listener = fd;
+    armAccept();
+  }
+
+  // the pending accept ends once `listener` is shut down.
+  void unlisten() { listener = -1; }
+
+  void connect(UringPeer* p, int fd, const sockaddr* addr, socklen_t len) {
+    p->io = this;
+    p->fd = fd;
+    auto e = ring.get();
+    if (!e) {
+      defer(p, OpConnect, addr, len);
+      return;
+    }
+    prep(e, IORING_OP_CONNECT, fd, p, OpConnect);
+    e->addr = (uint64_t)addr;
+    e->off = len;
+    p->ops++;
+  }
+
+  // Handle the completions posted so far, then write what they produced and
+  // re-arm what ended, submitted together. With `timeout` block up to that
+  // long for a completion first when there is none.
+  void update(std::chrono::nanoseconds timeout = {}) {
+    if (!sweep() && timeout.count() > 0) {
+      ring.submit(true, timeout);
+      sweep();
+    }
+    ring.submit();
+  }
+
+ private:
+  friend class UringPeer;
+
+  // a zero copy send from the registered slot, `OpSendFixed + half`.
+  enum Op : uint64_t {
+    OpRecv = 1,
+    OpSend,
+    OpAccept,
+    OpConnect,
+    OpSendFixed,
+    OpAcceptRetry = OpSendFixed + 2
+  };
+  static constexpr uint64_t OpMask = 7;
+  static constexpr __kernel_timespec AcceptRetry{0, 100000000};
+  static constexpr uint16_t BufGroup = 1;
+
+  static void prep(io_uring_sqe* e,
+                   int opcode,
+                   int fd,
+                   UringPeer* p,
+                   uint64_t op) {
+    e->opcode = (uint8_t)opcode;
+    e->fd = fd;
+    e->user_data = (uint64_t)p | op;
+  }
+
+  unsigned sweep() {
+    auto n = ring.reap([this](const io_uring_cqe& c) {
+      stats.completions++;
+      auto p = (UringPeer*)(c.user_data & ~OpMask);
+      switch (c.user_data & OpMask) {
+        case OpRecv:
+          onRecv(p, c);
+          break;
+        case OpSend:
+          onSend(p, c, -1);
+          break;
+        case OpSendFixed:
+        case OpSendFixed + 1:
+          onSend(p, c, (int)(c.user_data & OpMask) - OpSendFixed);
+          break;
+        case OpAccept:
+          if (c.res >= 0 && accepted)
+            accepted(c.res);
+          if (!(c.flags & IORING_CQE_F_MORE) && listener >= 0) {
+            if (c.res >= 0) {
+              armAccept();
+              break;
+            }
+            // out of descriptors (EMFILE, ENFILE) won't clear up right away.
+            error_code err(-c.res, std::system_category());
+            printf("accept: %s\n", err.message().c_str());
+            armAcceptRetry();
+          }
+          break;
+        case OpAcceptRetry:
+          if (listener >= 0)
+            armAccept();
+          break;
+        case OpConnect:
+          p->ops--;
+          if (c.res == 0)
+            armRecv(p);
+          if (connected)
+            connected(c.res);
+          break;
+      }
+      if (p && p->closing && p->idle())
+        p->onIdle();
+    });
+    commitBuffers();
+    retryDeferred();
+    for (auto p : rearm) {
+      if (!p->closing && p->fd >= 0)
+        armRecv(p);
+    }
+    rearm.clear();
+    // the replies of this sweep, one write per connection.
+    for (size_t i = 0; i < dirty.size(); i++) {
+      dirty[i]->dirty = false;
+      write(dirty[i]);
+    }
+    dirty.clear();
+    return n;
+  }
+
+  void onRecv(UringPeer* p, const io_uring_cqe& c) {
+    auto more = (c.flags & IORING_CQE_F_MORE) != 0;
+    if (!more)
+      p->ops--;
+    if (c.flags & IORING_CQE_F_BUFFER) {
+      auto bid = (uint16_t)(c.flags >> IORING_CQE_BUFFER_SHIFT);
+      if (c.res > 0 && !p->closing)
+        consume(p, bufData.data() + bid * opts.bufferBytes, c.res);
+      giveBack(bid);
+    }
+    if (c.res == -ENOBUFS || (c.res > 0 && !more)) {
+      // out of buffers or stopped for another reason, try again once those
+      // of this sweep are back.
+      rearm.push_back(p);
+    } else if (c.res <= 0 && !more && !p->closing) {
+      p->onError(c.res ? error_code(-c.res, std::system_category())
+                       : make_error_code(asio::error::eof));
+    }
+  }
+
+  void consume(UringPeer* p, const char* data, size_t len) {
+    auto& in = p->frames.input;
+    if (in.writable() < len)
+      in.compact(len);
+    memcpy(in.writePtr(), data, len);
+    in.commit(len);
+    if (!p->frames.parse(p->receiver)) {
+      p->onError(make_error_code(asio::error::invalid_argument));
+    }
+  }
+
+  void write(UringPeer* p) {
+    if (p->sending || p->fd < 0 || p->closing)
+      return;
+    if (p->used[p->fill]) {
+      p->sendIndex = p->fill;
+      p->sendPtr = p->out[p->fill];
+      p->sendLeft = p->used[p->fill];
+      p->fill ^= 1;
+    } else if (!p->spill.empty()) {
+      p->spilling.swap(p->spill);
+      p->spill.clear();
+      p->sendIndex = -1;
+      p->sendPtr = p->spilling.data();
+      p->sendLeft = p->spilling.size();
+    } else {
+      return;
+    }
+    p->sending = true;
+    p->stats.writes++;
+    submitWrite(p);
+  }
+
+  void submitWrite(UringPeer* p) {
+    auto e = ring.get();
+    if (!e) {
+      defer(p, OpSend);
+      return;
+    }
+    auto half = p->sendIndex;
+    if (half >= 0 && fixedSends) {
+      prep(e, IORING_OP_SEND_ZC, p->fd, p, OpSendFixed + half);
+      e->ioprio = IORING_RECVSEND_FIXED_BUF;
+      e->buf_index = 0;
+      p->held[half]++;
+      stats.fixedWrites++;
+    } else {
+      prep(e, IORING_OP_SEND, p->fd, p, OpSend);
+    }
+    e->addr = (uint64_t)p->sendPtr;
+    e->len = (unsigned)std::min<size_t>(p->sendLeft, INT_MAX);
+    e->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    stats.writes++;
+    p->ops++;
+  }
+
+  // a zero copy send completes twice: with its result, then once the
+  // kernel let go of the memory.
+  void onSend(UringPeer* p, const io_uring_cqe& c, int half) {
+    if (!(c.flags & IORING_CQE_F_MORE))
+      p->ops--;
+    if (c.flags & IORING_CQE_F_NOTIF) {
+      p->held[half]--;
+      return;
+    }
+    // a zero copy send that failed, as when it isn't supported, gets no
+    // notification to let go of its half.
+    if (half >= 0 && !(c.flags & IORING_CQE_F_MORE))
+      p->held[half]--;
+    auto res = c.res;
+    if (half >= 0 && (res == -EINVAL || res == -EOPNOTSUPP)) {
+      // the kernel or the socket can't send registered memory as is, it is
+      // copied like any other from now on.
+      fixedSends = false;
+      submitWrite(p);
+      return;
+    }
+    if (res < 0) {
+      p->sending = false;
+      if (!p->closing)
+        p->onError(error_code(-res, std::system_category()));
+      return;
+    }
+    p->stats.bytes += res;
+    p->sendPtr += res;
+    p->sendLeft -= res;
+    if (p->sendLeft && !p->closing) {
+      submitWrite(p);
+      return;
+    }
+    if (p->sendIndex >= 0)
+      p->used[p->sendIndex] = 0;
+    p->sending = false;
+    write(p);
+  }
+
+  void armRecv(UringPeer* p) {
+    auto e = ring.get();
+    if (!e) {
+      defer(p, OpRecv);
+      return;
+    }
+    prep(e, IORING_OP_RECV, p->fd, p, OpRecv);
+    e->ioprio = IORING_RECV_MULTISHOT;
+    e->flags = IOSQE_BUFFER_SELECT;
+    e->buf_group = BufGroup;
+    p->ops++;
+  }
+
+  void armAccept() {
+    auto e = ring.get();
+    if (!e) {
+      defer(nullptr, OpAccept);
+      return;
+    }
+    prep(e, IORING_OP_ACCEPT, listener, nullptr, OpAccept);
+    e->ioprio = IORING_ACCEPT_MULTISHOT;
+    e->accept_flags = SOCK_CLOEXEC;
+  }
+
+  void armAcceptRetry() {
+    auto e = ring.get();
+    if (!e) {
+      defer(nullptr, OpAccept);
+      return;
+    }
+    prep(e, IORING_OP_TIMEOUT, -1, nullptr, OpAcceptRetry);
+    e->addr = (uint64_t)&AcceptRetry;
+    e->len = 1;
+  }
+
+  // An op that found the submission queue full waits for the next sweep,
+  // counted as in flight so its peer stays.
+  struct Deferred {
+    UringPeer* p;
+    Op op;
+    const sockaddr* addr;
+    socklen_t len;
+  };
+
+  void defer(UringPeer* p,
+             Op op,
+             const sockaddr* addr = nullptr,
+             socklen_t len = 0) {
+    if (p)
+      p->ops++;
+    deferred.push_back({p, op, addr, len});
+  }
+
+  void retryDeferred() {
+    auto ops = std::move(deferred);
+    deferred.clear();
+    for (auto& d : ops) {
+      auto p = d.p;
+      if (p)
+        p->ops--;
+      switch (d.op) {
+        case OpRecv:
+          if (!p->closing)
+            armRecv(p);
+          break;
+        case OpSend:
+          if (!p->closing)
+            submitWrite(p);
+          else
+            p->sending = false;
+          break;
+        case OpConnect:
+          connect(p, p->fd, d.addr, d.len);
+          break;
+        case OpAccept:
+          if (listener >= 0)
+            armAccept();
+          break;
+        default:
+          break;
+      }
+      if (p && p->closing && p->idle())
+        p->onIdle();
+    }
+  }
+
+  void giveBack(uint16_t bid) {
+    // not through `bufs`, its flexible array is off by 8 bytes in C++.
+    auto bufs = (io_uring_buf*)bufRing;
+    auto& b = bufs[(bufTail + bufPending++) & (bufCount - 1)];
+    b.addr = (uint64_t)(bufData.data() + bid * opts.bufferBytes);
+    b.len = (unsigned)opts.bufferBytes;
+    b.bid = bid;
+  }
+
+  void commitBuffers() {
+    if (!bufPending)
+      return;
+    bufTail += bufPending;
+    bufPending = 0;
+    __atomic_store_n(&bufRing->tail, bufTail, __ATOMIC_RELEASE);
+  }
+
+  Options opts;
+  imp::Uring ring;
+  io_uring_buf_ring* bufRing = nullptr;
+  size_t bufRingSize = 0;
+  unsigned bufCount = 0;
+  uint16_t bufTail = 0;
+  uint16_t bufPending = 0;
+  vector<char> bufData;
+  vector<char> arena;
+  vector<int> freeSlots;
+  bool fixedSends = true;
+  int listener = -1;
+  vector<UringPeer*> dirty, rearm;
+  vector<Deferred> deferred;
+};
+
+inline void UringPeer::markDirty() {
+  if (dirty || !io)
+    return;
+  dirty = true;
+  io->dirty.push_back(this);
+}
+
+//////////////////////////////////////////////////////////////////////////
+
+class UringClient : public RpcClient<MemIStream, MemOStream>, public UringPeer {
+ public:
+  UringTransport::Options options;
+
+  UringClient() : RpcClient(output) {}
+  ~UringClient() { close(); }
+
+  void connect(string host, int port, Action<bool> cb) {
+    if (!transport.open(options)) {
+      cb(false);
+      return;
+    }
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+    receive([this](MemIStream& in) { onReceive(in); });
+    transport.connected = [cb](int res) { cb(res == 0); };
+    auto fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    transport.connect(this, imp::noDelay(fd), (const sockaddr*)&addr,
+                      sizeof(addr));
+    transport.update();
+
+    flush = [this] { send(output); };
+  }
+
+  // codec of the frames this client sends, replies come in whatever codec
+  // the server uses.
+  void setCodec(Codec c) { output.setCodec(c); }
+
+  // handle replies, waiting up to `timeout` for them when there are none.
+  void update(std::chrono::nanoseconds timeout = {}) {
+    transport.update(timeout);
+    if (hasDeadlines()) {
+      auto now = std::chrono::steady_clock::now();
+      if (now - lastExpire >= TimerTick) {
+        lastExpire = now;
+        expire(now);
+      }
+    }
+  }
+
+  // hang up, pending calls and streams end with Status::Cancelled.
+  void close() {
+    transport.shutdown(this);
+    while (!transport.release(this))
+      transport.update(TimerTick);
+    connectionLost();
+  }
+
+  void onError(const error_code& err) override {
+    UringPeer::onError(err);
+    transport.shutdown(this);
+    connectionLost();
+  }
+
+  size_t enters() const { return transport.enters(); }
+
+ private:
+  UringTransport transport;
+  sockaddr_in addr{};
+  MemOStream output;
+  std::chrono::steady_clock::time_point lastExpire;
+};
+
+//////////////////////////////////////////////////////////////////////////
+
+// A single event loop driven by update() on the caller's thread. To use
+// more cores run a server per thread with `reusePort` on the same port.
+class UringServer : public RpcServer<MemIStream, MemOStream> {
+ public:
+  UringTransport::Options options;
+  bool reusePort = false;
+  Codec codec = Codec::Raw;
+  // largest frame a client may send.
+  size_t maxFrame = FrameReader::DefaultMaxFrame;
+
+  ~UringServer() { stop(); }
+
+  void start(int port, Action<bool> cb) {
+    flush = [this](SessionID sid) {
+      if (auto s = findSession(sid))
+        s->send(s->os);
+    };
+    encodeFrame = [this](const Action<MemOStream&>& write) {
+      MemOStream o;
+      o.setCodec(codec);
+      write(o);
+      return AsioPeer::shareFrame(o, {});
+    };
+    sendFrame = [this](SessionID sid, const SharedFrame& frame) {
+      if (auto s = findSession(sid))
+        s->sendShared(frame);
+    };
+    io.accepted = [this](int fd) { open(fd); };
+
+    listener = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int on = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    if (reusePort)
+      setsockopt(listener, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    if (listener < 0 || bind(listener, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+        ::listen(listener, SOMAXCONN) < 0 || !io.open(options)) {
+      stop();
+      cb(false);
+      return;
+    }
+    io.listen(listener);
+    io.update();
+    cb(true);
+  }
+
+  void stop() {
+    for (auto& s : sessions)
+      close(s.get());
+    for (auto& s : sessions) {
+      while (!io.release(s.get()))
+        io.update(TimerTick);
+    }
+    if (listener >= 0) {
+      io.unlisten();
+      ::shutdown(listener, SHUT_RDWR);
+      ::close(listener);
+      io.update();
+    }
+    listener = -1;
+  }
+
+  struct Session : UringPeer {
+    SessionID sid = -1;
+    int slot;
+    SessionID generation = 0;
+    bool closed = true;
+    bool pooled = false;
+    MemOStream os;
+    UringServer* server;
+
+    Session(UringServer* s, int slot) : slot(slot), server(s) {}
+    void onError(const error_code& err) override { server->onError(err, this); }
+    void onIdle() override { server->close(this); }
+  };
+
+  void onError(const error_code& err, Session* s) {
+    if (err != asio::error::eof && err.value() != ECONNRESET &&
+        err.value() != EPIPE && err.value() != ECANCELED)
+      printf("%s\n", err.message().c_str());
+    close(s);
+  }
+
+  void close(Session* s) {
+    if (!s->closed) {
+      s->closed = true;
+      io.shutdown(s);
+      removeSession(s->sid);
+    }
+    // the session is reused only after its last operation completed.
+    if (io.release(s)) {
+      s->os.reset();
+      if (!s->pooled) {
+        s->pooled = true;
+        freeSessions.push_back(s);
+      }
+    }
+  }
+
+  // handle what completed, waiting up to `timeout` for something when
+  // nothing did.
+  void update(std::chrono::nanoseconds timeout = {}) { io.update(timeout); }
+
+  size_t enters() const { return io.enters(); }
+  const UringTransport::Stats& transportStats() const { return io.stats; }
+
+ private:
+  static constexpr int MaxSessions = 1 << 16;
+
+  Session* findSession(SessionID sid) {
+    size_t slot = sid % MaxSessions;
+    if (sid < 0 || slot >= sessions.size())
+      return nullptr;
+    auto s = sessions[slot].get();
+    return s->sid == sid && !s->closed ? s : nullptr;
+  }
+
+  void open(int fd) {
+    Session* s;
+    if (!freeSessions.empty()) {
+      s = freeSessions.back();
+      freeSessions.pop_back();
+    } else if (sessions.size() < MaxSessions) {
+      sessions.push_back(make_unique<Session>(this, (int)sessions.size()));
+      s = sessions.back().get();
+    } else {
+      ::close(fd);
+      return;
+    }
+    s->pooled = false;
+    s->generation = (s->generation + 1) % (INT64_MAX / MaxSessions);
+    s->sid = s->generation * MaxSessions + s->slot;
+    s->closed = false;
+    s->os.setCodec(codec);
+    s->setMaxFrame(maxFrame);
+    addSession(s->sid, s->os);
+    s->receive([this, sid = s->sid](MemIStream& in) { onReceive(sid, in); });
+    io.attach(s, imp::noDelay(fd));
+  }
+
+  UringTransport io;
+  int listener = -1;
+  vector<unique_ptr<Session>> sessions;
+  vector<Session*> freeSessions;
+};
+
+}  // namespace trpc
+
+#endif
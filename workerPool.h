@@ -0,0 +1,112 @@
+//////////////////////////////////////////////////////////////////////////
+// Bounded work-stealing thread pool
+//
+// by soniced@sina.com.
+// All rights reserved.
+//////////////////////////////////////////////////////////////////////////
+
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace trpc {
+
+// Tasks are dealt round-robin into per-worker queues. A worker runs its own
+// queue front to back and, once it is empty, steals from the back of the
+// others, so one slow task only delays the tasks queued behind it on the
+// same worker until someone steals them.
+class WorkerPool {
+ public:
+  using Task = std::function<void()>;
+
+  WorkerPool(int threads, size_t capacity) : capacity(capacity) {
+    for (int i = 0; i < threads; i++)
+      workers.push_back(std::make_unique<Worker>());
+    for (int i = 0; i < threads; i++)
+      workers[i]->thread = std::thread([this, i] { run(i); });
+  }
+
+  // runs whatever is still queued, then joins the workers.
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> l(sleepLock);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (auto& w : workers)
+      w->thread.join();
+  }
+
+  // false if `capacity` tasks are already waiting.
+  bool submit(Task t) {
+    if (queued.fetch_add(1) >= capacity) {
+      queued--;
+      return false;
+    }
+    auto& w = *workers[next++ % workers.size()];
+    {
+      std::lock_guard<std::mutex> l(w.lock);
+      w.tasks.push_back(std::move(t));
+    }
+    { std::lock_guard<std::mutex> l(sleepLock); }
+    wake.notify_one();
+    return true;
+  }
+
+ private:
+  struct Worker {
+    std::mutex lock;
+    std::deque<Task> tasks;
+    std::thread thread;
+  };
+
+  bool take(size_t self, Task& t) {
+    for (size_t n = 0; n < workers.size(); n++) {
+      auto& w = *workers[(self + n) % workers.size()];
+      std::lock_guard<std::mutex> l(w.lock);
+      if (w.tasks.empty())
+        continue;
+      if (n == 0) {
+        t = std::move(w.tasks.front());
+        w.tasks.pop_front();
+      } else {
+        t = std::move(w.tasks.back());
+        w.tasks.pop_back();
+      }
+      queued--;
+      return true;
+    }
+    return false;
+  }
+
+  void run(size_t self) {
+    Task t;
+    for (;;) {
+      if (take(self, t)) {
+        t();
+        t = nullptr;
+        continue;
+      }
+      std::unique_lock<std::mutex> l(sleepLock);
+      wake.wait(l, [this] { return stopping || queued > 0; });
+      if (stopping && queued == 0)
+        return;
+    }
+  }
+
+  const size_t capacity;
+  std::vector<std::unique_ptr<Worker>> workers;
+  std::atomic<size_t> queued{0};
+  std::atomic<size_t> next{0};
+  std::mutex sleepLock;
+  std::condition_variable wake;
+  bool stopping = false;
+};
+
+}  // namespace trpc